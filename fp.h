@@ -125,9 +125,7 @@ struct __attribute__ ((aligned(16))) __attribute__ ((__packed__)) fxsave {
      0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,\
      0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,\
      0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}}).fxsave
-#else
-  #error "This only works on x86_64 for now"
-#endif
+#endif /* other architectures keep their FP registers in rfile itself */
 
 
 #endif
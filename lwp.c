@@ -8,21 +8,39 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/mempolicy.h>
+
+/* build with -DLWP_DEBUG for a line on stderr at every create, yield,
+ * wait and exit */
+#ifdef LWP_DEBUG
+#define lwp_debug(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define lwp_debug(...) ((void) 0)
+#endif
 
 /* Round Robin scheduler */
 static thread sched_head = NULL;
 static thread sched_tail = NULL;
-void rr_init(void){
+static void rr_init(void){
     sched_head = NULL;
     sched_tail = NULL;
 }
 
-void rr_shutdown(void){
+static void rr_shutdown(void){
     sched_head = NULL;
     sched_tail = NULL;
 }
 
-void rr_admit(thread new){
+static void rr_admit(thread new){
     new->sched_one = NULL;
     if (sched_head == NULL){
         sched_head = new;
@@ -34,7 +52,7 @@ void rr_admit(thread new){
     }
 }
 
-void rr_remove(thread victim){
+static void rr_remove(thread victim){
     if (sched_head == NULL) return;
 
     thread curr = sched_head;
@@ -62,7 +80,7 @@ void rr_remove(thread victim){
     }
 }
 
-thread rr_next(void){
+static thread rr_next(void){
     if (sched_head == NULL){
         return NULL;
     }
@@ -82,6 +100,27 @@ thread rr_next(void){
     return next;
 }
 
+/* splice up to n threads off the head onto the tail in one go */
+static int rr_next_n(thread *out, int n){
+    int cnt = 0;
+    thread last = NULL;
+    thread iter = sched_head;
+
+    while (iter != NULL && cnt < n){
+        out[cnt++] = iter;
+        last = iter;
+        iter = iter->sched_one;
+    }
+
+    if (iter != NULL){
+        sched_tail->sched_one = sched_head;
+        sched_head = iter;
+        last->sched_one = NULL;
+        sched_tail = last;
+    }
+    return cnt;
+}
+
 static struct scheduler rr_publish = {rr_init, rr_shutdown, rr_admit, rr_remove, rr_next};
 static scheduler RoundRobin = &rr_publish;
 
@@ -89,40 +128,499 @@ static scheduler sched = NULL;
 
 /* helpers and globals */
 static thread curr_td = NULL;
-static thread wait_head = NULL;
-static thread zomb_head = NULL;
-static void lwp_wrap(lwpfun, void *);
-void swap_rfiles(rfile *old, rfile *new);
+
+/* explicit head/tail queues threaded through lib_one (next) and lib_two
+ * (prev), so push, pop and unlink are all O(1) */
+struct lwp_queue {
+    thread head;
+    thread tail;
+};
+
+static struct lwp_queue wait_q = {NULL, NULL};  /* blocked in lwp_wait */
+static struct lwp_queue zomb_q = {NULL, NULL};  /* exited, not reaped   */
+static void lwp_wrap(void *);
+static void group_exit(thread td);
+static void sched_admit(thread td);
+void swap_rfiles(rfile *old, rfile *new) __attribute__ ((visibility("hidden")));
 static struct threadinfo_st mainSysThread;
 
-void add_queue(thread *list_head, thread new_td) {
-    if (*list_head) {
-        new_td->lib_one = *list_head;
-        new_td->lib_two = (*list_head)->lib_two;
-        (*list_head)->lib_two->lib_one = new_td;
-        (*list_head)->lib_two = new_td;
+/* log-linear buckets, exact below sub and then sub of them per power
+ * of two, so 64 * sub buckets cover any 64-bit value */
+static int log_bucket(uint64_t v, int sub) {
+    int lg = 0;
+    if (v < sub) return v;
+    while ((v >> lg) >= 2 * sub) lg++;
+    return (lg + 1) * sub + (int)((v >> lg) - sub);
+}
+
+/* smallest value that is past everything in the bucket */
+static uint64_t log_bucket_top(int b, int sub) {
+    int lg = b / sub - 1;
+    if (b < sub) return b + 1;
+    return ((uint64_t)(b % sub + sub + 1)) << lg;
+}
+
+/* scheduler metrics, HDR-style: 16 buckets per power of two keeps every
+ * value within about 6% */
+#define HIST_SUB 16
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct lwp_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t b[HIST_BUCKETS];
+};
+
+static struct lwp_hist wake_hist;   /* admit to first run, ticks       */
+static struct lwp_hist slice_hist;  /* one stretch on the CPU, ticks   */
+static struct lwp_hist depth_hist;  /* pool size at each switch        */
+static int pool_cnt = 0;            /* threads admitted to sched, now  */
+
+static inline void hist_add(struct lwp_hist *h, uint64_t v) {
+    h->count++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+    h->b[log_bucket(v, HIST_SUB)]++;
+}
+
+/* accounting: a context is in one of these states, and the time since
+ * it entered it is charged to that state's counter on the way out */
+#define ST_RUNNING 0
+#define ST_READY   1
+#define ST_BLOCKED 2
+#define ST_EXITED  3
+#define ST_WOKEN   4  /* ready because it was admitted, not because it yielded */
+
+static inline uint64_t lwp_ticks(void) {
+#if defined(LWP_NO_STATS)
+    return 0;
+#elif defined(__x86_64)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t t;
+    __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (t));
+    return t;
+#endif
+}
+
+static inline void stat_charge(thread td, lwp_stats_t *st, uint64_t now) {
+    uint64_t spent = now - td->stat_since;
+    if (td->stat_state == ST_RUNNING) st->run_ticks += spent;
+    else if (td->stat_state == ST_READY || td->stat_state == ST_WOKEN)
+        st->ready_ticks += spent;
+    else if (td->stat_state == ST_BLOCKED) st->blocked_ticks += spent;
+}
+
+static inline void stat_enter(thread td, unsigned int state) {
+#ifndef LWP_NO_STATS
+    uint64_t now = lwp_ticks();
+    stat_charge(td, &td->stats, now);
+    if (td->stat_state == ST_RUNNING && state != ST_RUNNING)
+        hist_add(&slice_hist, now - td->stat_since);
+    else if (td->stat_state == ST_WOKEN && state == ST_RUNNING)
+        hist_add(&wake_hist, now - td->stat_since);
+    td->stat_since = now;
+#endif
+    td->stat_state = state;
+}
+
+static void stat_init(thread td, unsigned int state) {
+    memset(&td->stats, 0, sizeof(td->stats));
+    td->stats.tid = td->tid;
+    td->stat_since = lwp_ticks();
+    td->stat_state = state;
+}
+
+/* USDT probes for perf, bpftrace and friends, if the headers are here */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define LWP_PROBE1(name, a)    DTRACE_PROBE1(lwp, name, a)
+#define LWP_PROBE2(name, a, b) DTRACE_PROBE2(lwp, name, a, b)
+#endif
+#endif
+#ifndef LWP_PROBE1
+#define LWP_PROBE1(name, a)    ((void) 0)
+#define LWP_PROBE2(name, a, b) ((void) 0)
+#endif
+
+/* Chrome trace-event output: one complete ("X") event per slice on the
+ * CPU, buffered and written out in big chunks */
+#define TRACE_BUF 65536
+static int trace_fd = -1;
+static char *trace_buf;
+static size_t trace_len;
+static int trace_events;
+static uint64_t trace_slice;  /* when the current slice began, ns */
+
+static uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    size_t off = 0;
+    ssize_t n;
+    while (off < len) {
+        n = write(fd, buf + off, len - off);
+        if (n <= 0 && errno != EINTR) break;
+        if (n > 0) off += n;
     }
-    else {
-        *list_head = new_td;
-        (*list_head)->lib_one = *list_head;
-        (*list_head)->lib_two = *list_head;
+}
+
+static void trace_flush(void) {
+    write_all(trace_fd, trace_buf, trace_len);
+    trace_len = 0;
+}
+
+static void trace_event(const char *fmt, ...) {
+    va_list ap;
+    int len;
+
+    if (TRACE_BUF - trace_len < 512) trace_flush();
+    if (trace_events++) trace_buf[trace_len++] = ',';
+    trace_buf[trace_len++] = '\n';
+    va_start(ap, fmt);
+    len = vsnprintf(trace_buf + trace_len, TRACE_BUF - trace_len, fmt, ap);
+    va_end(ap);
+    if (len > 0) trace_len += len < 500 ? len : 500;
+}
+
+static void trace_name(thread td) {
+    trace_event("{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%lu,"
+        "\"args\":{\"name\":\"lwp %lu %p\"}}", (int) getpid(), td->tid, td->tid,
+        (void *)(uintptr_t) td->entry);
+}
+
+static void trace_instant(thread td, const char *what) {
+    trace_event("{\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"pid\":%d,\"tid\":%lu,"
+        "\"ts\":%.3f}", what, (int) getpid(), td->tid, trace_now() / 1000.0);
+}
+
+/* close the slice td has been running since trace_slice */
+static void trace_slice_end(thread td) {
+    uint64_t now = trace_now();
+    trace_event("{\"ph\":\"X\",\"name\":\"lwp %lu\",\"pid\":%d,\"tid\":%lu,"
+        "\"ts\":%.3f,\"dur\":%.3f}", td->tid, (int) getpid(), td->tid,
+        trace_slice / 1000.0, (now - trace_slice) / 1000.0);
+    trace_slice = now;
+}
+
+/* every switch goes through here.  swap_rfiles is hidden, so even in
+ * liblwp.so this inlines to a direct call with no PLT hop */
+static inline void ctx_switch(thread to) {
+    thread from = curr_td;
+    int saved_errno = errno;  //errno is per kernel thread, not per LWP
+    LWP_PROBE2(switch, from->tid, to->tid);
+    if (trace_fd != -1) trace_slice_end(from);
+    if (from->stat_state == ST_RUNNING) stat_enter(from, ST_READY);
+    from->stats.switches++;
+    stat_enter(to, ST_RUNNING);
+#ifndef LWP_NO_STATS
+    hist_add(&depth_hist, pool_cnt);
+#endif
+    curr_td = to;
+    swap_rfiles(&from->state, &to->state);
+    errno = saved_errno;
+}
+
+/* per-architecture pieces of a fresh register file */
+#if defined(__x86_64)
+#define init_fpu(td) ((td)->state.fxsave = FPU_INIT)
+#elif defined(__aarch64__)
+#define init_fpu(td) ((void) 0)  /* d8-d15 start zeroed with the rest */
+#endif
+
+/* local run cache, refilled through the scheduler's batch hook when it has one */
+#define RUN_CACHE_SIZE 8
+static thread run_cache[RUN_CACHE_SIZE];
+static int cache_pos = 0;
+static int cache_len = 0;
+
+/* batch hooks, keyed by scheduler */
+#define BATCH_HOOKS 8
+static struct {
+    scheduler     sched;
+    lwp_next_n_fn next_n;
+} batch_hooks[BATCH_HOOKS] = { { &rr_publish, rr_next_n } };
+static scheduler batch_for = NULL;  //sched_next_n is the hook for this one
+static lwp_next_n_fn sched_next_n = NULL;
+
+int lwp_set_scheduler_batch(scheduler s, lwp_next_n_fn next_n) {
+    int i, slot = -1;
+    for (i = 0; i < BATCH_HOOKS; i++) {
+        if (batch_hooks[i].sched == s) slot = i;
+        else if (!batch_hooks[i].sched && slot == -1) slot = i;
     }
+    if (slot == -1) return -1;
+    batch_hooks[slot].sched = next_n ? s : NULL;
+    batch_hooks[slot].next_n = next_n;
+    batch_for = NULL;
+    cache_pos = cache_len = 0;
+    return 0;
 }
 
-void rm_queue(thread *list_head, thread victim_td) {
-    if ((*list_head)->lib_one == *list_head && (*list_head)->tid == victim_td->tid) {
-        *list_head = NULL;
-        return;
+static thread sched_pick(void) {
+    int i;
+    if (sched != batch_for) {
+        batch_for = sched;
+        sched_next_n = NULL;
+        for (i = 0; i < BATCH_HOOKS; i++) {
+            if (batch_hooks[i].sched == sched) sched_next_n = batch_hooks[i].next_n;
+        }
+    }
+    if (!sched_next_n) return sched->next();
+
+    if (cache_pos == cache_len) {
+        cache_pos = 0;
+        cache_len = sched_next_n(run_cache, RUN_CACHE_SIZE);
+        if (cache_len <= 0) {
+            cache_len = 0;
+            return NULL;
+        }
+    }
+    return run_cache[cache_pos++];
+}
+
+/* idle state: the kernel thread parks here when nothing is runnable */
+static int idle_fd = -1;
+static int lwp_stopped = FALSE;
+static int live_cnt = 0;
+
+static int block_cnt = 0;
+static volatile sig_atomic_t dump_pending = 0;
+static int wd_fd = -1;
+static uint64_t wd_starve = 0;
+static void watchdog_stall(void);
+static void watchdog_tick(void);
+
+/* lib_flags bits */
+#define TD_PARKED 0x1               /* blocked in lwp_park             */
+#define TD_PERMIT 0x2               /* posted before it got to park    */
+#define TD_GROW   0x4               /* stack is committed on demand    */
+#define TD_CTX_ONSTACK 0x8          /* context lives at the stack top  */
+#define TD_QUEUED 0x10              /* on wait_q or zomb_q             */
+#define TD_LIVELY 0x20              /* watchdog: can still get to run  */
+
+static void idle_init(void) {
+    if (idle_fd != -1) return;
+    idle_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (idle_fd == -1) {
+        perror("idle_init: eventfd failed");
+        exit(1);
+    }
+}
+
+static void idle_kick(void) {
+    uint64_t one = 1;
+    int saved = errno;              //we may be inside a signal handler
+    if (idle_fd != -1) {
+        while (write(idle_fd, &one, sizeof(one)) == -1 && errno == EINTR)
+            ;
+    }
+    errno = saved;
+}
+
+static void lwp_idle(void) {
+    uint64_t cnt;
+    struct pollfd pfd = { .fd = idle_fd, .events = POLLIN };
+
+    // returns on a kick, or early when a signal handler interrupts us
+    if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+        perror("lwp_idle: poll failed");
+        exit(1);
+    }
+    if (read(idle_fd, &cnt, sizeof(cnt)) == -1
+            && errno != EAGAIN && errno != EINTR) {
+        perror("lwp_idle: read failed");
+        exit(1);
+    }
+}
+
+/*
+ * Posts from foreign threads and signal handlers go through a bounded
+ * lock-free ring (many producers, the runtime is the only consumer) and
+ * are drained at every scheduling point.  A slot's turn is even while it
+ * is free for lap turn/2 and odd while it holds an entry, so a
+ * zero-filled ring is ready to use.
+ */
+#define POST_RING_SIZE 256
+#define POST_WAKE  1
+#define POST_SPAWN 2
+
+struct post_slot {
+    atomic_size_t turn;
+    int           kind;
+    tid_t         tid;
+    lwpfun        fun;
+    void          *arg;
+};
+static struct post_slot post_ring[POST_RING_SIZE];
+static atomic_size_t post_tail = 0;
+static size_t post_head = 0;
+
+static int post_push(int kind, tid_t tid, lwpfun fun, void *arg) {
+    size_t pos = atomic_load_explicit(&post_tail, memory_order_relaxed);
+    for (;;) {
+        struct post_slot *slot = &post_ring[pos % POST_RING_SIZE];
+        size_t lap = 2 * (pos / POST_RING_SIZE);
+        size_t turn = atomic_load_explicit(&slot->turn, memory_order_acquire);
+
+        if (turn == lap) {
+            if (atomic_compare_exchange_weak_explicit(&post_tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                slot->kind = kind;
+                slot->tid = tid;
+                slot->fun = fun;
+                slot->arg = arg;
+                atomic_store_explicit(&slot->turn, lap + 1, memory_order_release);
+                idle_kick();
+                return 0;
+            }
+        }
+        else if (turn < lap) {
+            return -1;              //full: consumer is a lap behind
+        }
+        else {
+            pos = atomic_load_explicit(&post_tail, memory_order_relaxed);
+        }
     }
-    thread iter = *list_head;
-    while (iter->lib_one != *list_head) {
-        if (iter->tid == victim_td->tid) {
-            (*list_head)->lib_two->lib_one = (*list_head)->lib_one;
-            (*list_head)->lib_one->lib_two = (*list_head)->lib_two;
-            *list_head = (*list_head)->lib_two;
+}
+
+static void post_wake(tid_t tid) {
+    thread td = tid2thread(tid);
+    if (!td || LWPTERMINATED(td->status)) return;
+
+    if (td->lib_flags & TD_PARKED) {
+        td->lib_flags &= ~TD_PARKED;
+        block_cnt--;
+        sched_admit(td);
+    }
+    else {
+        td->lib_flags |= TD_PERMIT;
+    }
+}
+
+static void post_drain(void) {
+    for (;;) {
+        struct post_slot *slot = &post_ring[post_head % POST_RING_SIZE];
+        size_t lap = 2 * (post_head / POST_RING_SIZE);
+        if (atomic_load_explicit(&slot->turn, memory_order_acquire) != lap + 1)
             return;
+
+        int kind = slot->kind;
+        tid_t tid = slot->tid;
+        lwpfun fun = slot->fun;
+        void *arg = slot->arg;
+        atomic_store_explicit(&slot->turn, lap + 2, memory_order_release);
+        post_head++;
+
+        if (kind == POST_WAKE) post_wake(tid);
+        else if (kind == POST_SPAWN) lwp_create(fun, arg, 0);
+    }
+}
+
+/* admits after creation come through here so readiness gets stamped */
+static void sched_admit(thread td) {
+    stat_enter(td, td == curr_td ? ST_RUNNING : ST_WOKEN);
+    pool_cnt++;
+    sched->admit(td);
+}
+
+/* taking the current thread out of the pool means it is about to block */
+static void sched_remove(thread victim) {
+    int i, j;
+    if (victim == curr_td) {
+        stat_enter(victim, ST_BLOCKED);
+        if (!LWPTERMINATED(victim->status)) LWP_PROBE1(block, victim->tid);
+    }
+    pool_cnt--;
+    for (i = j = cache_pos; i < cache_len; i++) {
+        if (run_cache[i] != victim) run_cache[j++] = run_cache[i];
+    }
+    cache_len = j;
+    sched->remove(victim);
+}
+
+static void q_push(struct lwp_queue *q, thread td) {
+    td->lib_one = NULL;
+    td->lib_two = q->tail;
+    if (q->tail) q->tail->lib_one = td;
+    else q->head = td;
+    q->tail = td;
+    td->lib_flags |= TD_QUEUED;
+}
+
+static void q_remove(struct lwp_queue *q, thread td) {
+    if (td->lib_two) td->lib_two->lib_one = td->lib_one;
+    else q->head = td->lib_one;
+    if (td->lib_one) td->lib_one->lib_two = td->lib_two;
+    else q->tail = td->lib_two;
+    td->lib_one = td->lib_two = NULL;
+    td->lib_flags &= ~TD_QUEUED;
+}
+
+
+/* tid -> thread lookup, open addressing with linear probing */
+static thread *tid_map = NULL;
+static size_t tid_map_cap = 0;
+static size_t tid_map_cnt = 0;
+
+#define tid_slot(tid, cap) ( ((tid) * 0x9E3779B97F4A7C15UL) & ((cap) - 1) )
+
+static void tid_map_put(thread td) {
+    size_t i;
+    if (2 * (tid_map_cnt + 1) > tid_map_cap) {
+        size_t old_cap = tid_map_cap;
+        thread *old = tid_map;
+        tid_map_cap = old_cap ? 2 * old_cap : 64;
+        //runtime bookkeeping that lives as long as the process: kept out
+        //of smartalloc, which would report it as a leak at exit
+        tid_map = (calloc)(tid_map_cap, sizeof(thread));
+        if (!tid_map) {
+            perror("tid_map_put: calloc failed");
+            exit(1);
+        }
+        for (i = 0; i < old_cap; i++) {
+            if (old[i]) {
+                size_t j = tid_slot(old[i]->tid, tid_map_cap);
+                while (tid_map[j]) j = (j + 1) & (tid_map_cap - 1);
+                tid_map[j] = old[i];
+            }
         }
-        iter = iter->lib_one;
+        if (old) (free)(old);
+    }
+    i = tid_slot(td->tid, tid_map_cap);
+    while (tid_map[i]) i = (i + 1) & (tid_map_cap - 1);
+    tid_map[i] = td;
+    tid_map_cnt++;
+}
+
+static void tid_map_del(tid_t tid) {
+    size_t mask = tid_map_cap - 1;
+    size_t i, j, home;
+    if (!tid_map) return;
+
+    i = tid_slot(tid, tid_map_cap);
+    while (tid_map[i] && tid_map[i]->tid != tid) i = (i + 1) & mask;
+    if (!tid_map[i]) return;
+
+    //shift the rest of the probe run back over the hole
+    j = i;
+    for (;;) {
+        tid_map[i] = NULL;
+        do {
+            j = (j + 1) & mask;
+            if (!tid_map[j]) {
+                tid_map_cnt--;
+                return;
+            }
+            home = tid_slot(tid_map[j]->tid, tid_map_cap);
+        } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        tid_map[i] = tid_map[j];
+        i = j;
     }
 }
 
@@ -130,87 +628,604 @@ void rm_queue(thread *list_head, thread victim_td) {
 /* lwp functionality */
 #define DFLT_STACK 8*1024*1024
 
+/* sits just below an inline buffer so lwp_result_free can find the stack */
+struct stack_hdr {
+    unsigned long *base;
+    size_t        size;
+};
+
 static tid_t tid_cntr = NO_THREAD;
-tid_t lwp_create(lwpfun fun, void *param, size_t size) {
-    if (!sched) sched = RoundRobin;
-    
+
+static size_t stack_bytes(void) {
     size_t stack_size;
     long page_size = sysconf(_SC_PAGE_SIZE);
-    if (page_size == -1) stack_size = DFLT_STACK;
+    if (page_size == -1) return DFLT_STACK;
     struct rlimit r1;
     if (getrlimit(RLIMIT_STACK, &r1) == -1) stack_size = DFLT_STACK;
     else if (r1.rlim_cur == RLIM_INFINITY || r1.rlim_cur == 0) stack_size = DFLT_STACK;
     else stack_size = r1.rlim_cur;
 
-    stack_size = ((stack_size + page_size - 1) / page_size) * page_size; //round up to page size
+    return ((stack_size + page_size - 1) / page_size) * page_size; //round up to page size
+}
 
-    unsigned long *s = (unsigned long *)mmap(NULL,stack_size,
-        PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK,-1,0);
+/*
+ * Growable stacks: reserve a big PROT_NONE region up front, commit only
+ * the top few pages and let the SIGSEGV handler (running on its own
+ * alternate stack) commit more as the thread runs into them.  The lowest
+ * page is never committed and stays as a guard.
+ */
+#define GROW_RESERVE (64*1024*1024)
+#define GROW_INIT_PAGES 2
+#define GROW_STEP_PAGES 4
 
-    if(s == MAP_FAILED) {
-        perror("lwp_create: stack creation failed\n");
-        return NO_THREAD;
+static int grow_stacks = FALSE;
+static long grow_page = 4096;
+static int prof_mode = LWP_STACKPROF_OFF;
+#define STACK_PATTERN 0xA5
+static struct sigaction grow_oldact;
+
+static void grow_handler(int sig, siginfo_t *info, void *uctx) {
+    thread td = curr_td;
+    char *addr = (char *) info->si_addr;
+
+    if (td && (td->lib_flags & TD_GROW)) {
+        char *guard_end = (char *) td->stack + grow_page;
+        char *lo = (char *) td->stack + td->stacksize - td->stack_hwm;
+
+        if (addr >= guard_end && addr < lo) {
+            char *new_lo = (char *)((uintptr_t) addr & ~(uintptr_t)(grow_page - 1));
+            new_lo -= GROW_STEP_PAGES * grow_page;
+            if (new_lo < guard_end) new_lo = guard_end;
+            if (mprotect(new_lo, lo - new_lo, PROT_READ|PROT_WRITE) == 0) {
+                if (prof_mode != LWP_STACKPROF_OFF)
+                    memset(new_lo, STACK_PATTERN, lo - new_lo);
+                td->stack_hwm += lo - new_lo;
+                return;
+            }
+        }
+    }
+
+    //not ours: hand it to whoever was there before, or die as usual
+    if (grow_oldact.sa_flags & SA_SIGINFO) {
+        grow_oldact.sa_sigaction(sig, info, uctx);
+    }
+    else if (grow_oldact.sa_handler != SIG_DFL && grow_oldact.sa_handler != SIG_IGN) {
+        grow_oldact.sa_handler(sig);
+    }
+    else {
+        signal(sig, SIG_DFL);
+    }
+}
+
+void lwp_set_growable_stacks(int enable) {
+    static int installed = FALSE;
+    grow_stacks = enable;
+    if (!enable || installed) return;
+
+    grow_page = sysconf(_SC_PAGE_SIZE);
+    stack_t alt;
+    alt.ss_size = 4 * SIGSTKSZ;
+    alt.ss_sp = mmap(NULL, alt.ss_size, PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    alt.ss_flags = 0;
+    if (alt.ss_sp == MAP_FAILED || sigaltstack(&alt, NULL) == -1) {
+        perror("lwp_set_growable_stacks: sigaltstack failed");
+        grow_stacks = FALSE;
+        return;
+    }
+
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_sigaction = grow_handler;
+    act.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_NODEFER;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGSEGV, &act, &grow_oldact);
+    installed = TRUE;
+}
+
+/*
+ * Stack placement: instead of one mapping per stack, carve stacks out of
+ * 2MB-aligned arenas that can be backed by transparent huge pages and
+ * bound to the NUMA node of the kernel thread that creates them.
+ * Released stacks give their pages back and go on a free list (the node
+ * lives at the top of the stack itself) to be reused for the next stack
+ * of the same length.  Contexts of placed stacks sit at the top of their
+ * stack; a guard page at the bottom keeps an overflow out of the
+ * neighbour below.
+ */
+#define ARENA_ALIGN (2*1024*1024)
+#define ARENA_BYTES (64*1024*1024)
+
+struct stack_arena {
+    char               *base;
+    size_t             size;
+    size_t             used;
+    int                node;
+    struct stack_arena *next;
+};
+
+struct free_stack {
+    char              *base;
+    size_t            len;
+    int               node;
+    struct free_stack *next;
+};
+
+static int place_flags = LWP_PLACE_DEFAULT;
+static struct stack_arena *arenas = NULL;
+static struct free_stack *free_stacks = NULL;
+
+void lwp_set_stack_placement(int flags) {
+    place_flags = flags;
+}
+
+/* growable stacks need their own PROT_NONE reservation, so they win */
+static int placing(void) {
+    return place_flags != LWP_PLACE_DEFAULT && !grow_stacks;
+}
+
+static int current_node(void) {
+    unsigned int cpu, node;
+    if (!(place_flags & LWP_PLACE_NUMA)) return -1;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == -1) return -1;
+    return node;
+}
+
+static struct stack_arena *arena_new(size_t min, int node) {
+    size_t size = ARENA_BYTES;
+    if (min > size) size = (min + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    char *raw = mmap(NULL, size + ARENA_ALIGN, PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+
+    //trim to a 2MB boundary on both ends
+    char *base = (char *)(((uintptr_t) raw + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1));
+    if (base > raw) munmap(raw, base - raw);
+    if (raw + ARENA_ALIGN > base) munmap(base + size, raw + ARENA_ALIGN - base);
+
+    if (place_flags & LWP_PLACE_HUGE) madvise(base, size, MADV_HUGEPAGE);
+    if (node >= 0 && node < 8 * (int)sizeof(unsigned long)) {
+        unsigned long mask = 1UL << node;
+        syscall(SYS_mbind, base, size, MPOL_PREFERRED, &mask, 8 * sizeof(mask), 0);
+    }
+
+    //the library's own bookkeeping stays out of smartalloc's leak report
+    struct stack_arena *arena = (malloc)(sizeof(struct stack_arena));
+    if (!arena) {
+        munmap(base, size);
+        return NULL;
+    }
+    arena->base = base;
+    arena->size = size;
+    arena->used = 0;
+    arena->node = node;
+    arena->next = arenas;
+    arenas = arena;
+    return arena;
+}
+
+static unsigned long *arena_alloc(size_t len) {
+    int node = current_node();
+    struct free_stack **link, *fs;
+    struct stack_arena *arena;
+
+    for (link = &free_stacks; (fs = *link); link = &fs->next) {
+        if (fs->len == len && fs->node == node) {
+            *link = fs->next;
+            return (unsigned long *) fs->base;
+        }
     }
 
-    thread td = (thread) malloc(sizeof(context));
+    for (arena = arenas; arena; arena = arena->next) {
+        if (arena->node == node && arena->size - arena->used >= len) break;
+    }
+    if (!arena && !(arena = arena_new(len, node))) return MAP_FAILED;
+
+    char *base = arena->base + arena->used;
+    arena->used += len;
+    return (unsigned long *) base;
+}
+
+static int stack_unmap(void *base, size_t len) {
+    struct stack_arena *arena;
+    for (arena = arenas; arena; arena = arena->next) {
+        if ((char *) base >= arena->base && (char *) base < arena->base + arena->size) {
+            struct free_stack *fs = (struct free_stack *)((char *) base + len) - 1;
+            mprotect(base, len, PROT_READ|PROT_WRITE);      //drop any guard page
+            madvise(base, len, MADV_DONTNEED);              //before fs is written
+            fs->base = base;
+            fs->len = len;
+            fs->node = arena->node;
+            fs->next = free_stacks;
+            free_stacks = fs;
+            return 0;
+        }
+    }
+    return munmap(base, len);
+}
+
+/* reserve (growable) or map len bytes of stack */
+static unsigned long *stack_map(size_t len) {
+    if (placing()) return arena_alloc(len);
+
+    int prot = grow_stacks ? PROT_NONE : PROT_READ|PROT_WRITE;
+    int flags = MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK;
+    if (grow_stacks) flags |= MAP_NORESERVE;
+    return (unsigned long *)mmap(NULL, len, prot, flags, -1, 0);
+}
+
+/*
+ * Stack profiling: new stacks are filled with STACK_PATTERN, and on exit
+ * the deepest overwritten byte gives the thread's high-water mark.  Marks
+ * are kept per entry function in log-linear histograms (four buckets per
+ * power of two); in adaptive mode the next stack for a function is sized
+ * from its observed p99.
+ */
+#define PROF_HASH 31
+#define PROF_SUB 4
+#define PROF_BUCKETS (64 * PROF_SUB)
+#define ADAPT_MIN_RUNS 16
+#define ADAPT_MIN_STACK (16*1024)
+
+struct stack_prof {
+    lwpfun            fun;
+    unsigned long     runs;
+    size_t            max;
+    unsigned long     hist[PROF_BUCKETS];
+    struct stack_prof *next;
+};
+
+static struct stack_prof *prof_table[PROF_HASH];
+
+void lwp_set_stack_profiling(int mode) {
+    grow_page = sysconf(_SC_PAGE_SIZE);
+    prof_mode = mode;
+}
+
+
+static struct stack_prof *prof_lookup(lwpfun fun, int create) {
+    unsigned long h = ((uintptr_t) fun >> 4) % PROF_HASH;
+    struct stack_prof *p;
+
+    for (p = prof_table[h]; p; p = p->next) {
+        if (p->fun == fun) return p;
+    }
+    if (!create) return NULL;
+
+    //kept for the life of the process, so not smartalloc's to report
+    p = (calloc)(1, sizeof(struct stack_prof));
+    if (!p) return NULL;
+    p->fun = fun;
+    p->next = prof_table[h];
+    prof_table[h] = p;
+    return p;
+}
+
+static size_t prof_percentile(struct stack_prof *p, int pct) {
+    unsigned long want = (p->runs * pct + 99) / 100;
+    unsigned long seen = 0;
+    int b;
+    for (b = 0; b < PROF_BUCKETS; b++) {
+        seen += p->hist[b];
+        if (seen >= want) return log_bucket_top(b, PROF_SUB);
+    }
+    return p->max;
+}
+
+/* fill the committed part of a fresh stack, leaving keep bytes at the top */
+static void stack_poison(thread td, size_t keep) {
+    char *lo = (char *) td->stack + td->stacksize - td->stack_hwm;
+    if (prof_mode == LWP_STACKPROF_OFF || keep >= td->stack_hwm) return;
+    memset(lo, STACK_PATTERN, td->stack_hwm - keep);
+}
+
+static void stack_prof_record(thread td) {
+    char *top = (char *) td->stack + td->stacksize;
+    unsigned long *iter = (unsigned long *)(top - td->stack_hwm);
+    unsigned long poison;
+    struct stack_prof *p;
+    size_t depth;
+
+    memset(&poison, STACK_PATTERN, sizeof(poison));
+    while ((char *) iter < top && *iter == poison) iter++;
+    depth = top - (char *) iter;
+
+    if (!(p = prof_lookup(td->entry, TRUE))) return;
+    p->runs++;
+    p->hist[log_bucket(depth, PROF_SUB)]++;
+    if (depth > p->max) p->max = depth;
+}
+
+static size_t stack_len(lwpfun fun) {
+    size_t len = stack_bytes();
+    if (grow_stacks && len < GROW_RESERVE) len = GROW_RESERVE;
+
+    if (prof_mode == LWP_STACKPROF_ADAPT && !grow_stacks) {
+        struct stack_prof *p = prof_lookup(fun, FALSE);
+        if (p && p->runs >= ADAPT_MIN_RUNS) {
+            size_t want = 2 * prof_percentile(p, 99) + grow_page;
+            if (want < ADAPT_MIN_STACK) want = ADAPT_MIN_STACK;
+            want = (want + grow_page - 1) / grow_page * grow_page;
+            if (want < len) len = want;
+        }
+    }
+    return len;
+}
+
+void lwp_stack_report(void) {
+    struct stack_prof *p;
+    int h;
+
+    fprintf(stderr, "%-18s %8s %10s %10s %10s %10s\n",
+        "lwpfun", "runs", "p50", "p99", "max", "next");
+    for (h = 0; h < PROF_HASH; h++) {
+        for (p = prof_table[h]; p; p = p->next) {
+            fprintf(stderr, "%-18p %8lu %10zu %10zu %10zu %10zu\n",
+                (void *)(uintptr_t) p->fun, p->runs,
+                prof_percentile(p, 50), prof_percentile(p, 99), p->max,
+                stack_len(p->fun));
+        }
+    }
+}
+
+/* commit the top of a growable stack, enough for extra bytes plus slack */
+static void stack_prepare(thread td, size_t extra) {
+    td->stack_hwm = td->stacksize;
+    if (!grow_stacks) {
+        //adaptive stacks are small enough to be worth a guard page, and
+        //group members and placed stacks are likely back to back
+        if (prof_mode == LWP_STACKPROF_ADAPT || td->group || placing()) {
+            mprotect(td->stack, grow_page, PROT_NONE);
+            td->stack_hwm -= grow_page;
+        }
+        stack_poison(td, extra);
+        return;
+    }
+
+    size_t want = ((extra + grow_page - 1) / grow_page + GROW_INIT_PAGES) * grow_page;
+    if (want > td->stacksize - grow_page) want = td->stacksize - grow_page;
+    mprotect((char *) td->stack + td->stacksize - want, want, PROT_READ|PROT_WRITE);
+    td->stack_hwm = want;
+    td->lib_flags |= TD_GROW;
+    stack_poison(td, extra);
+}
+
+static void init_thread(thread td, unsigned long *s, size_t stack_size) {
     tid_cntr++;
-    fprintf(stderr, "created thread %d\n", (int) tid_cntr);
+    lwp_debug("created thread %d\n", (int) tid_cntr);
     td->tid = tid_cntr;
+    td->lib_flags = 0;
+    td->result = NULL;
+    td->group = NULL;
+    td->scratch = NULL;
+    td->specific = NULL;
+    td->wait_tid = NO_THREAD;
+    td->wait_group = NULL;
     td->stack = s;
     td->stacksize = stack_size;
     td->status = MKTERMSTAT(LWP_LIVE,0);
-    td->state.fxsave = FPU_INIT;
-    
-    td->state.rdi = (unsigned long) fun;
-    td->state.rsi = (unsigned long) param;
+    memset(&td->state, 0, sizeof(td->state));
+    init_fpu(td);
+    stat_init(td, ST_READY);
+}
+
+static void init_frame(thread td, lwpfun fun, void *param, unsigned long *s_top) {
+    td->entry = fun;
+    td->arg = param;
+    ctx_init(&td->state, td->stack, (char *) s_top - (char *) td->stack,
+        lwp_wrap, td);
+}
+
+static void admit_thread(thread td) {
+    idle_init();
+    smartalloc_set_owner(lwp_gettid);
+    tid_map_put(td);
+    live_cnt++;
+    LWP_PROBE2(create, td->tid, td->entry);
+    if (trace_fd != -1) trace_name(td);
+    sched_admit(td);
+}
+
+static thread new_thread(lwpfun fun, void *param, size_t bufsize) {
+    if (!sched) sched = RoundRobin;
     
-    unsigned long *s_top = (unsigned long *)((char *) td->stack + td->stacksize);
-    s_top = (unsigned long *) ((unsigned long)s_top & ~(16)); //alignment
-    // *(--s_top) = 0;
-    *(--s_top) = (unsigned long) lwp_wrap; //this is not working <<<
-    *(--s_top) = 0;
+    size_t stack_size = stack_len(fun);
+    unsigned long *s = stack_map(stack_size);
+
+    if(s == MAP_FAILED) {
+        perror("lwp_create: stack creation failed\n");
+        return NULL;
+    }
+
+    //placed stacks carry their own context at the top
+    size_t ctx_len = placing() ? (sizeof(context) + 63) & ~(size_t)63 : 0;
+    thread td;
+    if (ctx_len) td = (thread)((char *) s + stack_size - ctx_len);
+    else td = (thread) malloc(sizeof(context));
+
+    init_thread(td, s, stack_size);
+    if (ctx_len) td->lib_flags |= TD_CTX_ONSTACK;
+    stack_prepare(td, ctx_len + bufsize + sizeof(struct stack_hdr));
     
-    td->state.rbp = (unsigned long) s_top;
-    td->state.rsp = (unsigned long) s_top;
+    unsigned long *s_top = (unsigned long *)((char *) td->stack + td->stacksize - ctx_len);
+    s_top = (unsigned long *) ((unsigned long)s_top & ~15UL); //alignment
 
-    sched->admit(td);
+    if (bufsize) {
+        struct stack_hdr *hdr;
+        s_top = (unsigned long *)((char *) s_top - bufsize);
+        td->result = param = s_top;
+        hdr = (struct stack_hdr *) s_top - 1;
+        hdr->base = s;
+        hdr->size = stack_size;
+        s_top = (unsigned long *) hdr;
+    }
+
+    init_frame(td, fun, param, s_top);
+    admit_thread(td);
+    return td;
+}
+
+tid_t lwp_create(lwpfun fun, void *param, size_t size) {
+    thread td = new_thread(fun, param, 0);
+    return td ? td->tid : NO_THREAD;
+}
+
+tid_t lwp_create_ex(lwpfun fun, size_t bufsize, void **buf, size_t size) {
+    bufsize = (bufsize + 15) & ~(size_t)15;
+    if (!bufsize) bufsize = 16;
+
+    thread td = new_thread(fun, NULL, bufsize);
+    if (!td) return NO_THREAD;
+    if (buf) *buf = td->result;
     return td->tid;
 }
 
 void  lwp_start(void) {
     if (!sched) sched = RoundRobin;
-    
+
+    //restarting after lwp_stop: the system thread is already known
+    if (lwp_stopped) {
+        lwp_stopped = FALSE;
+        lwp_yield();
+        return;
+    }
+
     thread td = &mainSysThread;
     memset(&td->state, 0, sizeof(td->state));
     tid_cntr++;
-    fprintf(stderr, "start with thread %d\n", (int)tid_cntr);
+    lwp_debug("start with thread %d\n", (int)tid_cntr);
     td->tid = tid_cntr;
     td->status = MKTERMSTAT(LWP_LIVE,0);
     td->stack = NULL;
-    td->state.fxsave = FPU_INIT;
+    init_fpu(td);
+    td->lib_flags = 0;
+    td->group = NULL;
+    td->stack_hwm = 0;
+    td->entry = NULL;
+    td->arg = NULL;
+    td->scratch = NULL;
+    td->specific = NULL;
+    td->wait_tid = NO_THREAD;
+    td->wait_group = NULL;
+    stat_init(td, ST_RUNNING);
     curr_td = td;
 
-    sched->admit(td);
+    idle_init();
+    smartalloc_set_owner(lwp_gettid);
+    tid_map_put(td);
+    live_cnt++;
+    sched_admit(td);
     lwp_yield();
 }
 
+/* LWP-local storage: a key is an index into every thread's slot array.
+ * Each create bumps the key's sequence number (odd while in use) and slots
+ * remember the sequence they were set under, so a value left behind by a
+ * deleted key never shows through a new one on the same index. */
+struct lwp_slot {
+    unsigned int seq;
+    void         *value;
+};
+
+static unsigned int key_seq[LWP_KEYS_MAX];
+static void (*key_dtor[LWP_KEYS_MAX])(void *);
+
+#define key_live(k) ((k) < LWP_KEYS_MAX && (key_seq[k] & 1))
+
+int lwp_key_create(lwp_key_t *key, void (*destructor)(void *)) {
+    lwp_key_t k;
+    for (k = 0; k < LWP_KEYS_MAX; k++) {
+        if (!(key_seq[k] & 1)) {
+            key_seq[k]++;
+            key_dtor[k] = destructor;
+            *key = k;
+            return 0;
+        }
+    }
+    return EAGAIN;
+}
+
+int lwp_key_delete(lwp_key_t key) {
+    if (!key_live(key)) return EINVAL;
+    key_seq[key]++;
+    key_dtor[key] = NULL;
+    return 0;
+}
+
+int lwp_setspecific(lwp_key_t key, const void *value) {
+    struct lwp_slot *slots;
+
+    if (!curr_td || !key_live(key)) return EINVAL;
+    slots = curr_td->specific;
+    if (!slots) {
+        slots = calloc(LWP_KEYS_MAX, sizeof(struct lwp_slot));
+        if (!slots) return ENOMEM;
+        curr_td->specific = slots;
+    }
+    slots[key].seq = key_seq[key];
+    slots[key].value = (void *) value;
+    return 0;
+}
+
+void *lwp_getspecific(lwp_key_t key) {
+    struct lwp_slot *slots = curr_td ? curr_td->specific : NULL;
+
+    if (!slots || !key_live(key) || slots[key].seq != key_seq[key]) return NULL;
+    return slots[key].value;
+}
+
+/* run destructors until the values stay NULL, then drop the slots */
+static void specific_free(thread td) {
+    struct lwp_slot *slots = td->specific;
+    int round, k, again = TRUE;
+
+    if (!slots) return;
+    for (round = 0; again && round < LWP_DESTRUCTOR_ITERATIONS; round++) {
+        again = FALSE;
+        for (k = 0; k < LWP_KEYS_MAX; k++) {
+            void *value = slots[k].value;
+            if (!value || slots[k].seq != key_seq[k] || !key_dtor[k]) continue;
+            slots[k].value = NULL;
+            key_dtor[k](value);
+            again = TRUE;
+        }
+    }
+    td->specific = NULL;
+    free(slots);
+}
+
 void  lwp_exit(int status) {
-    fprintf(stderr, "exiting thread %d\n", (int)curr_td->tid);
+    lwp_debug("exiting thread %d\n", (int)curr_td->tid);
     thread exit_td = curr_td;
-    sched->remove(curr_td);
+    specific_free(exit_td);  //destructors may still yield, so go first
     exit_td->status = MKTERMSTAT(LWP_TERM, status);
+    LWP_PROBE2(exit, exit_td->tid, status);
+    if (trace_fd != -1) trace_instant(exit_td, "exit");
+    sched_remove(curr_td);
+    stat_enter(exit_td, ST_EXITED);
+    live_cnt--;
+    if (prof_mode != LWP_STACKPROF_OFF && exit_td->stack) stack_prof_record(exit_td);
 
-    if(wait_head) {
-        thread waiting = wait_head;
-        rm_queue(&wait_head, waiting);
-        sched->admit(waiting);
+    //lwp_wait takes any thread, lwp_join_result only the one it names
+    thread waiting, next;
+    for (waiting = wait_q.head; waiting; waiting = next) {
+        next = waiting->lib_one;
+        if (waiting->wait_tid == NO_THREAD || waiting->wait_tid == exit_td->tid) {
+            q_remove(&wait_q, waiting);
+            sched_admit(waiting);
+        }
     }
 
-    add_queue(&zomb_head, exit_td);
+    //lwp_create_ex threads belong to lwp_join_result, lwp_wait can't have them
+    if (exit_td->group) group_exit(exit_td);
+    else if (!exit_td->result) q_push(&zomb_q, exit_td);
     lwp_yield();
 }
 
 tid_t lwp_gettid(void) {
+    //also the smartalloc owner hook, which may run before lwp_start
+    if (!curr_td) return (tid_t) NO_THREAD;
     if (LWPTERMSTAT(curr_td->status) == LWP_LIVE) {
         return curr_td->tid;
     }
@@ -219,74 +1234,319 @@ tid_t lwp_gettid(void) {
     }
 }
 
+void  lwp_stop(void) {
+    thread sys_td = &mainSysThread;
+    lwp_stopped = TRUE;
+    if (curr_td == sys_td) return;
+
+    //the system thread is gone, there is nowhere to return to
+    if (LWPTERMINATED(sys_td->status)) exit(LWPTERMSTAT(sys_td->status));
+
+    ctx_switch(sys_td);
+}
+
 void  lwp_yield(void) {
-    fprintf(stderr, "yield\n");
-    thread next_td = sched->next();
-    if (!next_td) exit(curr_td->status); //no more runnable threads
-    
-    thread old_td = curr_td;
-    curr_td = next_td;
-    swap_rfiles(&(old_td->state), &(next_td->state));
+    lwp_debug("yield\n");
+    if (lwp_stopped) {
+        if (curr_td != &mainSysThread) lwp_stop();
+        return;
+    }
+
+    post_drain();
+    if (wd_starve) watchdog_tick();
+    thread next_td = sched_pick();
+    int stalled = FALSE;
+    while (!next_td) {
+        //nobody blocked means nobody left who could ever become runnable
+        if (!wait_q.head && !block_cnt) exit(curr_td->status);
+        if (wd_fd != -1 && !stalled) watchdog_stall();
+        stalled = TRUE;
+        //idle time is nobody's slice
+        if (trace_fd != -1) trace_slice_end(curr_td);
+        lwp_idle();
+        if (trace_fd != -1) trace_slice = trace_now();
+        if (dump_pending) {
+            dump_pending = 0;
+            lwp_dump(2);
+        }
+        post_drain();
+        next_td = sched_pick();
+    }
+
+    if (dump_pending) {
+        dump_pending = 0;
+        lwp_dump(2);
+    }
+    ctx_switch(next_td);
 }
 
-tid_t lwp_wait(int *status) {
-    fprintf(stderr, "wait\n");
-    int stat;
-    int runnableCond = 0;
-    thread iter;
+/* block until some thread terminates; FALSE if lwp_stop woke us instead */
+static int block_wait(void) {
+    q_push(&wait_q, curr_td);
+    sched_remove(curr_td);
+    lwp_yield();
 
-    iter = curr_td;
-    /*if (iter) {
-        do {
-            stat = iter->status;
-            if (LWPTERMSTAT(stat) == LWP_LIVE) runnableCond = 1;
-            iter = iter->sched_one;
-        } while (iter != curr_td);
-    }*/
-    while (iter) {
-        stat = iter->status;
-        if (LWPTERMSTAT(stat) == LWP_LIVE) runnableCond = 1;
-        iter = iter->sched_one;
+    //still queued: lwp_exit never got to us
+    if (curr_td->lib_flags & TD_QUEUED) {
+        q_remove(&wait_q, curr_td);
+        sched_admit(curr_td);
+        return FALSE;
     }
+    return TRUE;
+}
 
-    if (!zomb_head) {
-        if (!runnableCond) return NO_THREAD;
+/* per-LWP scratch arena: a list of malloc'd chunks, newest first, that
+ * is bump-allocated and only ever freed as a whole */
+#define SCRATCH_CHUNK 16384
 
-        fprintf(stderr, "blocking\n");
-        //block until one terminates
-        add_queue(&wait_head, curr_td);
-        sched->remove(curr_td);
-        lwp_yield();
+struct scratch_chunk {
+    struct scratch_chunk *next;
+    size_t               used;
+    size_t               size;
+    unsigned long        data[] __attribute__ ((aligned(16)));
+};
+
+void *lwp_arena_alloc(size_t size) {
+    struct scratch_chunk *chunk;
+    size_t len;
+
+    if (!curr_td) return NULL;
+    size = (size + 15) & ~(size_t)15;
+    chunk = curr_td->scratch;
+    if (chunk && chunk->size - chunk->used >= size) {
+        void *p = (char *) chunk->data + chunk->used;
+        chunk->used += size;
+        return p;
     }
 
-    iter = zomb_head;
-    stat = iter->status;
+    //big requests get a chunk of their own behind the current one
+    len = size > SCRATCH_CHUNK / 4 ? size : SCRATCH_CHUNK;
+    chunk = malloc(sizeof(struct scratch_chunk) + len);
+    if (!chunk) return NULL;
+    chunk->size = len;
+    chunk->used = size;
+    if (len == size && curr_td->scratch) {
+        struct scratch_chunk *head = curr_td->scratch;
+        chunk->next = head->next;
+        head->next = chunk;
+    }
+    else {
+        chunk->next = curr_td->scratch;
+        curr_td->scratch = chunk;
+    }
+    return chunk->data;
+}
 
-    rm_queue(&zomb_head, iter);
-    *status = stat;
-    
-    tid_t term_tid = iter->tid;
-    if (iter->stack) {
-        if (munmap(iter->stack, iter->stacksize) == -1) {
+static void scratch_free(thread td) {
+    struct scratch_chunk *chunk, *next;
+    for (chunk = td->scratch; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    td->scratch = NULL;
+}
+
+static void reap(thread td, int keep_stack) {
+    int onstack = td->lib_flags & TD_CTX_ONSTACK;
+    if (td->lib_flags & TD_QUEUED) q_remove(&zomb_q, td);
+    tid_map_del(td->tid);
+    scratch_free(td);
+    if (td->stack && !keep_stack) {
+        if (stack_unmap(td->stack, td->stacksize) == -1) {
             perror("lwp_wait: munmap failed");
             exit(1);
         }
     }
-    free(iter);
+    if (!onstack) free(td);
+}
+
+tid_t lwp_wait(int *status) {
+    lwp_debug("wait\n");
+    thread iter;
+
+    while (!zomb_q.head) {
+        //nobody but us left alive: nothing will ever terminate
+        if (live_cnt <= 1 || lwp_stopped) return NO_THREAD;
 
-    //pop blocking thread off wait queue and re-admit to scheduler
-    if (wait_head) {
-        sched->admit(wait_head);
-        rm_queue(&wait_head, wait_head);
+        lwp_debug("blocking\n");
+        if (!block_wait() && !zomb_q.head) return NO_THREAD;
     }
 
+    iter = zomb_q.head;
+    if (status) *status = iter->status;
+
+    tid_t term_tid = iter->tid;
+    reap(iter, FALSE);
     return term_tid;
 }
 
+void *lwp_join_result(tid_t tid, int *status) {
+    thread td = tid2thread(tid);
+    void *result;
+
+    if (!td || td == curr_td || td->group) return NULL;
+    while (!LWPTERMINATED(td->status)) {
+        int woken;
+        curr_td->wait_tid = tid;  //for the watchdog's wait-for graph
+        woken = block_wait();
+        curr_td->wait_tid = NO_THREAD;
+        if (!woken && !LWPTERMINATED(td->status)) return NULL;
+        //someone else may have reaped it while we slept
+        if (!(td = tid2thread(tid))) return NULL;
+    }
+
+    if (status) *status = td->status;
+    result = td->result;
+    reap(td, result != NULL);
+    return result;
+}
+
+void lwp_result_free(void *result) {
+    struct stack_hdr *hdr = (struct stack_hdr *) result - 1;
+    if (stack_unmap(hdr->base, hdr->size) == -1) {
+        perror("lwp_result_free: munmap failed");
+    }
+}
+
+/* task groups: members of one spawn share a context array, skip the
+ * zombie queue and are reaped together by the joiner */
+struct group_batch {
+    context            *members;
+    int                n;
+    struct group_batch *next;
+};
+
+struct lwp_group_st {
+    struct group_batch *batches;
+    struct group_batch **last;
+    int                live;
+    thread             joiner;
+};
+
+lwp_group_t lwp_group_create(void) {
+    lwp_group_t group = malloc(sizeof(struct lwp_group_st));
+    group->batches = NULL;
+    group->last = &group->batches;
+    group->live = 0;
+    group->joiner = NULL;
+    return group;
+}
+
+int lwp_group_spawn_n(lwp_group_t group, lwpfun fun, void *args[], int n) {
+    struct group_batch *batch;
+    size_t stack_size = stack_len(fun);
+    int i;
+
+    if (n <= 0) return 0;
+    if (!sched) sched = RoundRobin;
+
+    batch = malloc(sizeof(struct group_batch));
+    batch->members = malloc(n * sizeof(context));
+    batch->n = n;
+    batch->next = NULL;
+
+    //one mapping per member, like lwp_create: a single n-stack mapping
+    //runs into the overcommit limit long before n separate ones do
+    for (i = 0; i < n; i++) {
+        unsigned long *s = stack_map(stack_size);
+        if (s == MAP_FAILED) {
+            perror("lwp_group_spawn_n: stack creation failed");
+            while (i--) stack_unmap(batch->members[i].stack, stack_size);
+            free(batch->members);
+            free(batch);
+            return 0;
+        }
+        batch->members[i].stack = s;
+    }
+    *group->last = batch;
+    group->last = &batch->next;
+
+    for (i = 0; i < n; i++) {
+        thread td = &batch->members[i];
+        unsigned long *stack = td->stack;
+        init_thread(td, stack, stack_size);
+        td->group = group;
+        stack_prepare(td, 0);
+        init_frame(td, fun, args ? args[i] : NULL,
+            (unsigned long *)((char *) stack + stack_size));
+    }
+    for (i = 0; i < n; i++) admit_thread(&batch->members[i]);
+
+    group->live += n;
+    return n;
+}
+
+/* called from lwp_exit: the last member out wakes the joiner, once */
+static void group_exit(thread td) {
+    lwp_group_t group = td->group;
+    if (--group->live == 0 && group->joiner) {
+        sched_admit(group->joiner);
+        group->joiner = NULL;
+        block_cnt--;
+    }
+}
+
+int lwp_group_join_all(lwp_group_t group, int *statuses) {
+    struct group_batch *batch, *next;
+    int i, cnt = 0;
+
+    if (group->live > 0) {
+        if (lwp_stopped) return -1;
+        group->joiner = curr_td;
+        curr_td->wait_group = group;
+        block_cnt++;
+        sched_remove(curr_td);
+        lwp_yield();
+        curr_td->wait_group = NULL;
+
+        //woken by lwp_stop rather than by the last member
+        if (group->joiner == curr_td) {
+            group->joiner = NULL;
+            block_cnt--;
+            sched_admit(curr_td);
+            return -1;
+        }
+    }
+
+    for (batch = group->batches; batch; batch = next) {
+        next = batch->next;
+        for (i = 0; i < batch->n; i++) {
+            thread td = &batch->members[i];
+            if (statuses) statuses[cnt] = td->status;
+            tid_map_del(td->tid);
+            scratch_free(td);
+            if (stack_unmap(td->stack, td->stacksize) == -1) {
+                perror("lwp_group_join_all: munmap failed");
+            }
+            cnt++;
+        }
+        free(batch->members);
+        free(batch);
+    }
+    group->batches = NULL;
+    group->last = &group->batches;
+    return cnt;
+}
+
+int lwp_group_destroy(lwp_group_t group) {
+    if (group->batches) lwp_group_join_all(group, NULL);
+    //lwp_stop cut the join short and the members still point at us
+    if (group->live > 0) return -1;
+    free(group);
+    return 0;
+}
+
 void  lwp_set_scheduler(scheduler new_sched) {
     if (!new_sched) new_sched = RoundRobin;
     if (new_sched->init) new_sched->init();
     if (new_sched == sched) return;
+    cache_pos = cache_len = 0;
+
+    //picked before anything was created: nothing to transfer
+    if (!sched) {
+        sched = new_sched;
+        return;
+    }
 
     //transfer all threads
     thread next = sched->next();
@@ -303,29 +1563,509 @@ scheduler lwp_get_scheduler(void) {
     return sched;
 }
 
-thread tid2thread(tid_t tid) {
-    //search schedule
-    thread iter = curr_td;
-    while (iter->tid != tid) {
-        if (iter->sched_one == curr_td) break;
-        iter = iter->sched_one;
+static void stats_snapshot(thread td, lwp_stats_t *out) {
+    *out = td->stats;
+#ifndef LWP_NO_STATS
+    stat_charge(td, out, lwp_ticks());
+#endif
+}
+
+int lwp_stats(tid_t tid, lwp_stats_t *out) {
+    thread td = tid2thread(tid);
+    if (!td || !out) return -1;
+    stats_snapshot(td, out);
+    return 0;
+}
+
+int lwp_stats_all(lwp_stats_t *out, int max) {
+    size_t i;
+    int n = 0;
+    for (i = 0; i < tid_map_cap; i++) {
+        if (!tid_map[i]) continue;
+        if (n < max) stats_snapshot(tid_map[i], &out[n]);
+        n++;
     }
-    if (iter->tid == tid) return iter;
-    
-    //search wait queue
-    iter = wait_head;
-    while(iter->tid != tid) {
-        if (iter->lib_one == wait_head) break;
-        iter = iter->lib_one;
+    return n;
+}
+
+static void emitf(lwp_emit_fn emit, void *ctx, const char *fmt, ...) {
+    char buf[256];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len > (int) sizeof(buf) - 1) len = sizeof(buf) - 1;
+    if (len > 0) emit(ctx, buf, len);
+}
+
+/* upper end of the value at or below which permille of samples fall */
+static uint64_t hist_percentile(struct lwp_hist *h, int permille) {
+    uint64_t want = (h->count * permille + 999) / 1000;
+    uint64_t seen = 0, top;
+    int b;
+    if (!h->count) return 0;
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->b[b];
+        if (seen >= want) break;
     }
-    if (iter->tid == tid) return iter;
+    top = log_bucket_top(b, HIST_SUB) - 1;
+    return top < h->max ? top : h->max;
+}
+
+static void hist_dump(int format, const char *name, const char *help,
+        struct lwp_hist *h, lwp_emit_fn emit, void *ctx) {
+    typedef unsigned long long ull;
+    uint64_t bound = 1, cum = 0;
+    int b = 0;
 
+    if (format != LWP_METRICS_PROM) {
+        emitf(emit, ctx, "%-24s %10llu %10llu %10llu %10llu %10llu %10llu %10llu\n",
+            name, (ull) h->count, (ull)(h->count ? h->sum / h->count : 0),
+            (ull) hist_percentile(h, 500), (ull) hist_percentile(h, 900),
+            (ull) hist_percentile(h, 990), (ull) hist_percentile(h, 999),
+            (ull) h->max);
+        return;
+    }
+
+    //power-of-two bounds up to the max, so the set only ever grows
+    emitf(emit, ctx, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (;;) {
+        while (b < HIST_BUCKETS && log_bucket_top(b, HIST_SUB) <= bound) cum += h->b[b++];
+        emitf(emit, ctx, "%s_bucket{le=\"%llu\"} %llu\n", name, (ull)(bound - 1), (ull) cum);
+        if (bound > h->max || bound >> 63) break;
+        bound <<= 1;
+    }
+    emitf(emit, ctx, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %llu\n%s_count %llu\n",
+        name, (ull) h->count, name, (ull) h->sum, name, (ull) h->count);
+}
+
+void lwp_sched_metrics(int format, lwp_emit_fn emit, void *ctx) {
+    if (format != LWP_METRICS_PROM) {
+        emitf(emit, ctx, "%-24s %10s %10s %10s %10s %10s %10s %10s\n", "metric",
+            "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    }
+    hist_dump(format, "lwp_wakeup_latency_ticks",
+        "Ticks from being admitted to the scheduler to running.",
+        &wake_hist, emit, ctx);
+    hist_dump(format, "lwp_slice_ticks",
+        "Ticks an LWP ran before giving up the CPU.", &slice_hist, emit, ctx);
+    hist_dump(format, "lwp_runqueue_depth",
+        "Threads in the scheduler's pool at each switch.", &depth_hist, emit, ctx);
+}
+
+static void emit_fd(void *ctx, const char *buf, size_t len) {
+    if (write(*(int *) ctx, buf, len) < 0) return;
+}
+
+void lwp_sched_metrics_fd(int fd, int format) {
+    lwp_sched_metrics(format, emit_fd, &fd);
+}
+
+void lwp_sched_metrics_reset(void) {
+    memset(&wake_hist, 0, sizeof(wake_hist));
+    memset(&slice_hist, 0, sizeof(slice_hist));
+    memset(&depth_hist, 0, sizeof(depth_hist));
+}
+
+int lwp_trace_start(int fd) {
+    size_t i;
+
+    if (trace_fd != -1) return -1;
+    if (!(trace_buf = malloc(TRACE_BUF))) return -1;
+    trace_fd = fd;
+    trace_len = 0;
+    trace_events = 0;
+    trace_buf[trace_len++] = '[';
+    for (i = 0; i < tid_map_cap; i++) {
+        if (tid_map[i]) trace_name(tid_map[i]);
+    }
+    trace_slice = trace_now();
+    return 0;
+}
+
+void lwp_trace_stop(void) {
+    if (trace_fd == -1) return;
+    if (curr_td) trace_slice_end(curr_td);
+    trace_buf[trace_len++] = '\n';
+    trace_buf[trace_len++] = ']';
+    trace_buf[trace_len++] = '\n';
+    trace_flush();
+    free(trace_buf);
+    trace_buf = NULL;
+    trace_fd = -1;
+}
+
+/* introspection: every thread still in the tid map, where it is queued
+ * and a frame-pointer backtrace from its saved registers */
+#define DUMP_FRAMES 32
+
+#if defined(__x86_64)
+#define saved_fp(td) ((td)->state.rbp)  //swap_rfiles' own frame
+#define saved_sp(td) ((td)->state.rsp)
+#define saved_pc(td) 0
+#elif defined(__aarch64__)
+#define saved_fp(td) ((td)->state.fp)   //the caller's frame, no record
+#define saved_sp(td) ((td)->state.sp)
+#define saved_pc(td) ((td)->state.lr)
+#endif
+
+struct dump_buf {
+    int    fd;
+    size_t len;
+    char   buf[4096];
+};
+
+static void emit_dump(void *ctx, const char *buf, size_t len) {
+    struct dump_buf *d = ctx;
+    if (sizeof(d->buf) - d->len < len) {
+        write_all(d->fd, d->buf, d->len);
+        d->len = 0;
+    }
+    memcpy(d->buf + d->len, buf, len);
+    d->len += len;
+}
+
+/* one word of td's stack at or above sp; FALSE if it can't be read */
+static int stack_word(thread td, uintptr_t sp, uintptr_t addr, uintptr_t *out) {
+    struct iovec local = { out, sizeof(*out) };
+    struct iovec remote = { (void *) addr, sizeof(*out) };
+
+    if (addr < sp || addr & (sizeof(uintptr_t) - 1)) return FALSE;
+    if (td->stack) {
+        if (addr + sizeof(uintptr_t) > (uintptr_t) td->stack + td->stacksize)
+            return FALSE;
+        *out = *(uintptr_t *) addr;
+        return TRUE;
+    }
+    //the system thread's stack has no bounds we know of
+    return syscall(SYS_process_vm_readv, getpid(), &local, 1UL, &remote, 1UL, 0UL)
+        == sizeof(*out);
+}
+
+static void dump_backtrace(struct dump_buf *d, thread td,
+        uintptr_t pc, uintptr_t fp, uintptr_t sp) {
+    uintptr_t next;
+    int depth = 0;
+
+    if (pc) emitf(emit_dump, d, "    #%-2d 0x%lx\n", depth++, (unsigned long) pc);
+    //frames only ever get older going up, and a zero link ends the chain
+    while (depth < DUMP_FRAMES && stack_word(td, sp, fp + sizeof(uintptr_t), &pc)
+            && stack_word(td, sp, fp, &next) && pc) {
+        emitf(emit_dump, d, "    #%-2d 0x%lx\n", depth++, (unsigned long) pc);
+        if (next <= fp) break;
+        sp = fp;
+        fp = next;
+    }
+}
+
+static const char *dump_state(thread td) {
+    static const char *names[] = {"running", "ready", "blocked", "exited", "woken"};
+    return td->stat_state < sizeof(names) / sizeof(names[0])
+        ? names[td->stat_state] : "?";
+}
+
+/* what td is waiting on, by the primitive that took it out of the pool */
+static const char *dump_queue(thread td) {
+    if (td->stat_state == ST_RUNNING) return "-";
+    if (td->lib_flags & TD_QUEUED)
+        return LWPTERMINATED(td->status) ? "zomb_q" : "wait_q";
+    if (td->lib_flags & TD_PARKED) return "park";
+    if (LWPTERMINATED(td->status))
+        return td->group ? "group" : td->result ? "result" : "-";
+    if (td->stat_state == ST_BLOCKED) return "join";
+    return "run";
+}
+
+static void dump_thread(struct dump_buf *d, thread td) {
+    typedef unsigned long long ull;
+    uintptr_t fp, sp, pc;
+
+    if (td == curr_td) {
+        fp = (uintptr_t) __builtin_frame_address(0);
+        sp = fp;
+        pc = 0;
+    }
+    else {
+        fp = saved_fp(td);
+        sp = saved_sp(td);
+        pc = saved_pc(td);
+    }
+
+    emitf(emit_dump, d, "lwp %lu %s (%s) for %llu ticks, entry %p", td->tid,
+        dump_state(td), dump_queue(td), (ull)(lwp_ticks() - td->stat_since),
+        (void *)(uintptr_t) td->entry);
+    if (td->stack) {
+        emitf(emit_dump, d, ", stack %zu/%zu",
+            (size_t)((uintptr_t) td->stack + td->stacksize - sp), td->stacksize);
+        if (td->lib_flags & TD_GROW)
+            emitf(emit_dump, d, " (%zu committed)", td->stack_hwm);
+    }
+    if (LWPTERMINATED(td->status)) {
+        emitf(emit_dump, d, ", status %d\n", LWPTERMSTAT(td->status));
+        return;
+    }
+    if (td->wait_tid != NO_THREAD) emitf(emit_dump, d, ", joining lwp %lu", td->wait_tid);
+    else if (td->wait_group) emitf(emit_dump, d, ", joining its group");
+    emit_dump(d, "\n", 1);
+    dump_backtrace(d, td, pc, fp, sp);
+}
+
+static void dump_all(struct dump_buf *d) {
+    size_t i;
+    int blocked = 0;
+
+    for (i = 0; i < tid_map_cap; i++) {
+        if (tid_map[i] && tid_map[i]->stat_state == ST_BLOCKED) blocked++;
+    }
+    emitf(emit_dump, d, "lwp_dump: %d live, %d runnable, %d blocked, running %lu\n",
+        live_cnt, pool_cnt, blocked, curr_td ? curr_td->tid : NO_THREAD);
+    for (i = 0; i < tid_map_cap; i++) {
+        if (tid_map[i]) dump_thread(d, tid_map[i]);
+    }
+}
+
+void lwp_dump(int fd) {
+    struct dump_buf d;
+
+    d.fd = fd;
+    d.len = 0;
+    dump_all(&d);
+    write_all(d.fd, d.buf, d.len);
+}
+
+static void dump_handler(int sig) {
+    dump_pending = 1;
+    idle_kick();  //an idle runtime would otherwise not notice until woken
+}
+
+/* The handler only raises a flag: the dump is written at the next
+ * scheduling point, where the thread lists are consistent. */
+int lwp_dump_on_signal(int signo) {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dump_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    return sigaction(signo, &sa, NULL);
+}
+
+/*
+ * Watchdog.  A blocked thread waits on other threads: lwp_wait on any of
+ * them exiting, lwp_join_result on its target, a group joiner on every
+ * member still live.  Runnable threads can make progress, and so can
+ * parked ones as far as we can tell, since anybody may lwp_post them.
+ * Spreading that along the waits until nothing changes leaves exactly
+ * the threads that are deadlocked.
+ */
+void lwp_set_watchdog(int fd, uint64_t starve_ticks) {
+    wd_fd = fd;
+    wd_starve = fd == -1 ? 0 : starve_ticks;
+}
+
+static int lively(thread td) {
+    return td && (td->lib_flags & TD_LIVELY);
+}
+
+/* can the wait td is blocked in still be satisfied? */
+static int wait_lively(thread td, int any_lively) {
+    struct group_batch *batch;
+    int i;
+
+    if (td->wait_group) {
+        for (batch = td->wait_group->batches; batch; batch = batch->next) {
+            for (i = 0; i < batch->n; i++) {
+                thread m = &batch->members[i];
+                if (!LWPTERMINATED(m->status) && !lively(m)) return FALSE;
+            }
+        }
+        return TRUE;
+    }
+    if (td->wait_tid != NO_THREAD) return lively(tid2thread(td->wait_tid));
+    return any_lively;
+}
+
+/* a deadlocked thread td is waiting on */
+static thread wait_target(thread td) {
+    struct group_batch *batch;
+    size_t i;
+    int j;
+
+    if (LWPTERMINATED(td->status) || lively(td)) return NULL;
+    if (td->wait_group) {
+        for (batch = td->wait_group->batches; batch; batch = batch->next) {
+            for (j = 0; j < batch->n; j++) {
+                thread m = &batch->members[j];
+                if (!LWPTERMINATED(m->status) && !lively(m)) return m;
+            }
+        }
+        return NULL;
+    }
+    if (td->wait_tid != NO_THREAD) return tid2thread(td->wait_tid);
+    for (i = 0; i < tid_map_cap; i++) {
+        thread m = tid_map[i];
+        if (m && m != td && !LWPTERMINATED(m->status)) return m;
+    }
+    return NULL;
+}
+
+/* blocked on something that has already happened: a wakeup was lost */
+static int wait_satisfied(thread td) {
+    thread target;
+    if (td->wait_group) return td->wait_group->live == 0;
+    if (!(td->lib_flags & TD_QUEUED)) return FALSE;
+    if (td->wait_tid == NO_THREAD) return zomb_q.head != NULL;
+    target = tid2thread(td->wait_tid);
+    return !target || LWPTERMINATED(target->status);
+}
+
+static void report_cycle(struct dump_buf *d, thread start) {
+    thread td = start;
+    size_t steps = 0;
+
+    //walk until we are going round: that part is the cycle
+    while (td && steps++ < tid_map_cnt) td = wait_target(td);
+    if (!td) return;
+    start = td;
+    emitf(emit_dump, d, "lwp_watchdog: deadlock: lwp %lu", td->tid);
+    do {
+        td = wait_target(td);
+        emitf(emit_dump, d, " -> lwp %lu", td->tid);
+    } while (td != start);
+    emit_dump(d, "\n", 1);
+}
+
+static void watchdog_stall(void) {
+    struct dump_buf d;
+    thread td, first = NULL;
+    int changed = TRUE, any_lively = FALSE, stuck = 0, lost = 0;
+    size_t i;
+
+    for (i = 0; i < tid_map_cap; i++) {
+        if (!(td = tid_map[i]) || LWPTERMINATED(td->status)) continue;
+        if (td->stat_state == ST_BLOCKED) stuck++;
+        if (td->stat_state != ST_BLOCKED || td->lib_flags & TD_PARKED)
+            td->lib_flags |= TD_LIVELY;
+    }
+    d.fd = wd_fd;
+    d.len = 0;
+    emitf(emit_dump, &d, "lwp_watchdog: nothing runnable, %d blocked\n", stuck);
+    stuck = 0;
+    while (changed) {
+        changed = FALSE;
+        for (i = 0; i < tid_map_cap; i++) {
+            if ((td = tid_map[i]) && (td->lib_flags & TD_LIVELY)) any_lively = TRUE;
+        }
+        for (i = 0; i < tid_map_cap; i++) {
+            td = tid_map[i];
+            if (!td || LWPTERMINATED(td->status) || lively(td)) continue;
+            if (wait_lively(td, any_lively)) {
+                td->lib_flags |= TD_LIVELY;
+                changed = TRUE;
+            }
+        }
+    }
+
+    for (i = 0; i < tid_map_cap; i++) {
+        td = tid_map[i];
+        if (!td || LWPTERMINATED(td->status) || lively(td)) continue;
+        if (wait_satisfied(td)) {
+            emitf(emit_dump, &d, "lwp_watchdog: lost wakeup: lwp %lu is still "
+                "blocked on a wait that has been satisfied\n", td->tid);
+            lost++;
+        }
+        else {
+            if (!first) first = td;
+            stuck++;
+        }
+    }
+    if (first) {
+        emitf(emit_dump, &d, "lwp_watchdog: %d LWPs deadlocked\n", stuck);
+        report_cycle(&d, first);
+    }
+    else if (!lost) {
+        emitf(emit_dump, &d, "lwp_watchdog: every blocked LWP is parked or "
+            "waits on one, waiting for an lwp_post\n");
+    }
+    for (i = 0; i < tid_map_cap; i++) {
+        if (tid_map[i]) tid_map[i]->lib_flags &= ~TD_LIVELY;
+    }
+
+    dump_all(&d);
+    write_all(d.fd, d.buf, d.len);
+}
+
+/* runnable for longer than wd_starve; looked for once per wd_starve, and
+ * each wait is reported by the scan that sees it cross the threshold */
+static void watchdog_tick(void) {
+    static uint64_t last = 0;
+    uint64_t now = lwp_ticks(), prev = last;
+    struct dump_buf d;
+    thread td;
+    size_t i;
+
+    if (now - last < wd_starve) return;
+    last = now;
+    d.fd = wd_fd;
+    d.len = 0;
+    for (i = 0; i < tid_map_cap; i++) {
+        td = tid_map[i];
+        if (!td) continue;
+        if (td->stat_state != ST_READY && td->stat_state != ST_WOKEN) continue;
+        if (now - td->stat_since < wd_starve) continue;
+        if (prev > td->stat_since && prev - td->stat_since >= wd_starve) continue;
+        emitf(emit_dump, &d, "lwp_watchdog: lwp %lu runnable but not scheduled "
+            "for %llu ticks\n", td->tid, (unsigned long long)(now - td->stat_since));
+        dump_thread(&d, td);
+    }
+    write_all(d.fd, d.buf, d.len);
+}
+
+thread tid2thread(tid_t tid) {
+    size_t i;
+    if (!tid_map) return NO_THREAD;
+
+    i = tid_slot(tid, tid_map_cap);
+    while (tid_map[i]) {
+        if (tid_map[i]->tid == tid) return tid_map[i];
+        i = (i + 1) & (tid_map_cap - 1);
+    }
     return NO_THREAD;
 }
 
-static void lwp_wrap(lwpfun fun, void *arg) {
-    fprintf(stderr, "wrapper\n");
-    int rval = fun(arg);
-    fprintf(stderr, "finished lwpfun\n");
+int lwp_post(tid_t tid) {
+    return post_push(POST_WAKE, tid, NULL, NULL);
+}
+
+int lwp_submit(lwpfun fun, void *arg) {
+    return post_push(POST_SPAWN, NO_THREAD, fun, arg);
+}
+
+void lwp_park(void) {
+    if (lwp_stopped) return;
+    if (curr_td->lib_flags & TD_PERMIT) {
+        curr_td->lib_flags &= ~TD_PERMIT;
+        return;
+    }
+    curr_td->lib_flags |= TD_PARKED;
+    block_cnt++;
+    sched_remove(curr_td);
+    lwp_yield();
+
+    //woken by lwp_stop rather than by a post
+    if (curr_td->lib_flags & TD_PARKED) {
+        curr_td->lib_flags &= ~TD_PARKED;
+        block_cnt--;
+        sched_admit(curr_td);
+    }
+}
+
+static void lwp_wrap(void *arg) {
+    thread td = arg;
+    lwp_debug("wrapper\n");
+    int rval = td->entry(td->arg);
+    lwp_debug("finished lwpfun\n");
     lwp_exit(rval);
 }
@@ -49,7 +49,9 @@ typedef struct registers {
 } rfile;
 #elif defined(__aarch64__)
 typedef struct registers {
-  // 64-bit General Purpose Registers (x16, x17, and x19 - x31)
+  // 64-bit General Purpose Registers.  swap_rfiles only saves the
+  // callee-saved ones (x19 - x28, fp, lr, sp and d8 - d15); the rest
+  // keep the layout arm64_swap.S expects.
   uintptr_t x0;
   uintptr_t x1;
   uintptr_t x2;
@@ -96,10 +98,23 @@ typedef struct registers {
   #error "Architecture not supported"
 #endif
 
+typedef int (*lwpfun)(void *);  /* type for lwp function */
+
 typedef unsigned long tid_t;
 #define NO_THREAD 0             /* an always invalid thread id */
 
+/* per-LWP accounting, in ticks of the cycle counter (rdtsc on x86-64,
+ * cntvct_el0 on arm64).  Build with -DLWP_NO_STATS to leave it out. */
+typedef struct lwp_stats {
+  tid_t         tid;
+  uint64_t      run_ticks;      /* on the CPU                    */
+  uint64_t      ready_ticks;    /* runnable, waiting for the CPU */
+  uint64_t      blocked_ticks;  /* lwp_wait, lwp_park and joins  */
+  uint64_t      switches;       /* times it gave up the CPU      */
+} lwp_stats_t;
+
 typedef struct threadinfo_st *thread;
+typedef struct lwp_group_st *lwp_group_t;
 typedef struct threadinfo_st {
   tid_t         tid;            /* lightweight process id  */
   unsigned long *stack;         /* Base of allocated stack */
@@ -110,9 +125,21 @@ typedef struct threadinfo_st {
   thread        lib_two;        /* for use by the library  */
   thread        sched_one;      /* Two more for            */
   thread        sched_two;      /* schedulers to use       */
+  unsigned int  lib_flags;      /* library-private state   */
+  void          *result;        /* inline arg/result area  */
+  lwp_group_t   group;          /* task group, if any      */
+  size_t        stack_hwm;      /* bytes of stack committed */
+  lwpfun        entry;          /* function it was started with */
+  void          *scratch;       /* lwp_arena_alloc chunks  */
+  void          *arg;           /* argument for entry      */
+  void          *specific;      /* lwp_setspecific slots   */
+  lwp_stats_t   stats;          /* accounting so far       */
+  uint64_t      stat_since;     /* when it entered ...     */
+  unsigned int  stat_state;     /* ... its current state   */
+  tid_t         wait_tid;       /* lwp_join_result target  */
+  lwp_group_t   wait_group;     /* group it is joining     */
 } context;
 
-typedef int (*lwpfun)(void *);  /* type for lwp function */
 
 /* Tuple that describes a scheduler */
 typedef struct scheduler {
@@ -123,6 +150,14 @@ typedef struct scheduler {
   thread (*next)(void);            /* select a thread to schedule   */
 } *scheduler;
 
+/* optional batch hook for a scheduler: select up to n threads at once,
+ * in the order next() would have returned them */
+typedef int (*lwp_next_n_fn)(thread *out, int n);
+
+/* the API keeps default visibility when the library itself is built
+ * with -fvisibility=hidden; liblwp.map lists the same names */
+#pragma GCC visibility push(default)
+
 /* lwp functions */
 extern tid_t lwp_create(lwpfun,void *,size_t);
 extern void  lwp_exit(int status);
@@ -133,8 +168,116 @@ extern void  lwp_stop(void);
 extern tid_t lwp_wait(int *);
 extern void  lwp_set_scheduler(scheduler fun);
 extern scheduler lwp_get_scheduler(void);
+
+/* registered beside the scheduler rather than in it, so prebuilt
+ * five-entry schedulers keep working.  NULL unregisters; -1 if the
+ * table of hooks is full */
+extern int   lwp_set_scheduler_batch(scheduler s, lwp_next_n_fn next_n);
 extern thread tid2thread(tid_t tid);
 
+/* inline argument/result buffer: lwp_create_ex carves bufsize bytes off
+ * the top of the new stack, hands them to fun as its argument and stores
+ * their address in *buf.  lwp_join_result waits for that thread and
+ * returns the same address; the stack stays mapped until lwp_result_free.
+ * Only lwp_join_result collects these threads; lwp_wait passes them by */
+extern tid_t lwp_create_ex(lwpfun fun, size_t bufsize, void **buf, size_t size);
+extern void *lwp_join_result(tid_t tid, int *status);
+extern void  lwp_result_free(void *result);
+
+/* scratch arena: bump-allocate from chunks owned by the calling LWP.
+ * There is no free; everything goes at once when the thread is reaped. */
+extern void *lwp_arena_alloc(size_t size);
+
+/* LWP-local storage, the pthread_key_* calls for LWPs.  Destructors run
+ * in lwp_exit for every non-NULL value, up to LWP_DESTRUCTOR_ITERATIONS
+ * rounds.  errno is saved and restored across every switch, but plain
+ * __thread variables are still shared by all LWPs. */
+#define LWP_KEYS_MAX 64
+#define LWP_DESTRUCTOR_ITERATIONS 4
+typedef unsigned int lwp_key_t;
+extern int   lwp_key_create(lwp_key_t *key, void (*destructor)(void *));
+extern int   lwp_key_delete(lwp_key_t key);
+extern int   lwp_setspecific(lwp_key_t key, const void *value);
+extern void *lwp_getspecific(lwp_key_t key);
+
+/* lwp_stats fills in one LWP's counters, -1 if there is no such tid.
+ * lwp_stats_all copies up to max of them, in no particular order, and
+ * returns how many LWPs there are. */
+extern int   lwp_stats(tid_t tid, lwp_stats_t *out);
+extern int   lwp_stats_all(lwp_stats_t *out, int max);
+
+/* scheduler metrics: histograms of wake-up latency (admit to first run)
+ * and slice length in the same ticks as lwp_stats, and of the scheduler's
+ * pool size sampled at every switch.  Dumped as text or in Prometheus'
+ * exposition format, through emit or straight to an fd. */
+#define LWP_METRICS_TEXT 0
+#define LWP_METRICS_PROM 1
+typedef void (*lwp_emit_fn)(void *ctx, const char *buf, size_t len);
+extern void  lwp_sched_metrics(int format, lwp_emit_fn emit, void *ctx);
+extern void  lwp_sched_metrics_fd(int fd, int format);
+extern void  lwp_sched_metrics_reset(void);
+
+/* tracing: USDT probes lwp:create, lwp:switch, lwp:block and lwp:exit
+ * when built where <sys/sdt.h> is available, and on request a Chrome
+ * trace-event JSON timeline (chrome://tracing, Perfetto) of which LWP ran
+ * when, written to fd until lwp_trace_stop.  lwp_trace_start returns -1
+ * if a trace is already running. */
+extern int   lwp_trace_start(int fd);
+extern void  lwp_trace_stop(void);
+
+/* introspection: lwp_dump writes every live, blocked and zombie LWP to
+ * fd with its state, what it is queued on, how long it has been there,
+ * its stack use and a frame-pointer backtrace.  lwp_dump_on_signal
+ * arranges for signo to dump to stderr at the next scheduling point. */
+extern void  lwp_dump(int fd);
+extern int   lwp_dump_on_signal(int signo);
+
+/* watchdog: while fd is not -1, a runtime with nothing left to run
+ * writes why to fd -- deadlocked waits, with one cycle spelled out, and
+ * waits whose wakeup already happened -- followed by a full lwp_dump.
+ * With starve_ticks non-zero it also reports LWPs that have been
+ * runnable that long without being scheduled (never under
+ * LWP_NO_STATS, which has no clock). */
+extern void  lwp_set_watchdog(int fd, uint64_t starve_ticks);
+
+/* growable stacks: new LWPs reserve a large region but commit only a
+ * couple of pages, and grow on demand when they fault below them.
+ * stack_hwm in the context records how far each one has grown. */
+extern void  lwp_set_growable_stacks(int enable);
+
+/* stack placement: carve stacks from 2MB-aligned arenas, optionally
+ * backed by transparent huge pages and bound to the local NUMA node.
+ * Ignored while growable stacks are on. */
+#define LWP_PLACE_DEFAULT 0
+#define LWP_PLACE_HUGE    0x1
+#define LWP_PLACE_NUMA    0x2
+extern void  lwp_set_stack_placement(int flags);
+
+/* stack profiling: poison each new stack, measure how deep it got on
+ * exit and keep per-lwpfun histograms.  In ADAPT mode later stacks for
+ * the same function are sized from the observed p99. */
+#define LWP_STACKPROF_OFF   0
+#define LWP_STACKPROF_ON    1
+#define LWP_STACKPROF_ADAPT 2
+extern void  lwp_set_stack_profiling(int mode);
+extern void  lwp_stack_report(void);
+
+/* task groups: spawn n threads at once, fun(args[i]) for each, and
+ * collect them all with a single wake-up.  lwp_group_join_all fills
+ * statuses[] in spawn order and returns how many members it reaped.
+ * lwp_group_destroy joins what is left and frees the group; if lwp_stop
+ * leaves members running it returns -1 and the group stays valid */
+extern lwp_group_t lwp_group_create(void);
+extern int   lwp_group_spawn_n(lwp_group_t group, lwpfun fun, void *args[], int n);
+extern int   lwp_group_join_all(lwp_group_t group, int *statuses);
+extern int   lwp_group_destroy(lwp_group_t group);
+
+/* safe to call from other kernel threads and from signal handlers.
+ * Both return 0 once queued, -1 if the post queue is full. */
+extern int   lwp_post(tid_t tid);          /* make a parked LWP runnable */
+extern int   lwp_submit(lwpfun fun, void *arg); /* spawn an LWP          */
+extern void  lwp_park(void);               /* block until lwp_post(self) */
+
 /* for lwp_wait */
 #define TERMOFFSET        8
 #define MKTERMSTAT(a,b)   ( (a)<<TERMOFFSET | ((b) & ((1<<TERMOFFSET)-1)) )
@@ -148,4 +291,11 @@ void save_ctx(rfile *old);
 void load_ctx(rfile *new);
 void swap_ctx(rfile *old, rfile *new);
 
+/* set up r so that switching to it calls entry(arg) at the top of the
+ * given stack, properly aligned.  entry must never return. */
+void ctx_init(rfile *r, void *stack, size_t size,
+              void (*entry)(void *), void *arg);
+
+#pragma GCC visibility pop
+
 #endif
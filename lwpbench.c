@@ -0,0 +1,57 @@
+/*
+ * lwpbench:  time lwp_yield round trips.
+ *
+ *         usage: lwpbench [label]
+ *
+ *         For a few thread counts, every LWP yields YIELDS times and
+ *         the wall time per switch is printed after label, so the
+ *         static, shared and LTO builds of liblwp can be compared
+ *         side by side (see "make bench").
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "lwp.h"
+
+#define YIELDS 200000
+#define ROUNDS 3                 /* best of */
+
+static int yielder(void *arg) {
+  long i;
+  for(i=0;i<YIELDS;i++)
+    lwp_yield();
+  return 0;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]){
+  static int counts[] = {2, 16, 256};
+  const char *label = argc > 1 ? argv[1] : "liblwp";
+  int c, i, r, status;
+  double start, best, t;
+
+  lwp_start();
+  for(c=0;c<sizeof(counts)/sizeof(counts[0]);c++) {
+    best = 0;
+    for(r=0;r<ROUNDS;r++) {
+      for(i=0;i<counts[c];i++)
+        lwp_create(yielder,NULL,0);
+      start = now();
+      while ( lwp_wait(&status) != NO_THREAD )
+        ;
+      t = now() - start;
+      if ( !best || t < best )
+        best = t;
+    }
+    /* we sit in lwp_wait meanwhile: one switch per yield */
+    printf("%-8s %4d threads  %6.1f ns/switch\n",label,counts[c],
+           best * 1e9 / ((double)counts[c] * YIELDS));
+  }
+  return 0;
+}
@@ -0,0 +1,713 @@
+/*
+ * lwptest:  conformance tests for liblwp.
+ *
+ *         Each case runs in a child process of its own, since the
+ *         runtime keeps global state and some cases leave it stopped,
+ *         deadlocked or idle on purpose.  A case that hangs is killed
+ *         by an alarm and counts as failed.
+ *
+ *         usage: lwptest [-v] [case ...]
+ *           -v     keep the cases' stderr (reports, diagnostics)
+ *           case   run only the named cases
+ *
+ *         Exits non-zero if any case fails.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "lwp.h"
+#include "schedulers.h"
+#include "smartalloc.h"
+
+#define TIMEOUT 10               /* seconds before a case counts as hung */
+
+#define CHECK(c) do {                                               \
+    if ( !(c) ) {                                                   \
+      printf("    %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #c); \
+      fflush(stdout);                                               \
+      return 1;                                                     \
+    }                                                               \
+  } while (0)
+
+/* ---------------------------------------------------------------- */
+/* helpers shared by the cases                                      */
+
+static char order[64];           /* who ran when, one char per turn */
+static int olen;
+
+static int exitwith(void *arg) {
+  return (int)(long)arg;
+}
+
+static int taketurns(void *arg) {
+  int i;
+  for(i=0;i<3;i++) {
+    order[olen++] = 'a' + (int)(long)arg;
+    lwp_yield();
+  }
+  return 0;
+}
+
+/* collect every thread lwp_wait can give us; statuses are summed */
+static int waitall(int *sum) {
+  int status, n = 0;
+  *sum = 0;
+  while ( lwp_wait(&status) != NO_THREAD ) {
+    *sum += LWPTERMSTAT(status);
+    n++;
+  }
+  return n;
+}
+
+/* ---------------------------------------------------------------- */
+/* create, exit and wait                                            */
+
+static int t_create_wait(void) {
+  int i, sum;
+  for(i=1;i<=5;i++)
+    lwp_create(exitwith,(void*)(long)i,0);
+  lwp_start();
+  CHECK(waitall(&sum) == 5);
+  CHECK(sum == 1+2+3+4+5);
+  CHECK(lwp_wait(NULL) == NO_THREAD);
+  return 0;
+}
+
+static int t_round_robin(void) {
+  int sum;
+  lwp_create(taketurns,(void*)0,0);
+  lwp_create(taketurns,(void*)1,0);
+  lwp_create(taketurns,(void*)2,0);
+  lwp_start();
+  CHECK(waitall(&sum) == 3);
+  order[olen] = '\0';
+  CHECK(!strcmp(order,"abcabcabc"));
+  return 0;
+}
+
+static int t_scheduler(void) {
+  int sum;
+  lwp_set_scheduler(AlwaysZero);
+  lwp_create(taketurns,(void*)0,0);
+  lwp_create(taketurns,(void*)1,0);
+  lwp_start();
+  CHECK(waitall(&sum) == 2);
+  CHECK(olen == 6);
+  CHECK(lwp_get_scheduler() == AlwaysZero);
+  return 0;
+}
+
+/* ---------------------------------------------------------------- */
+/* inline result buffers                                            */
+
+static int fillbuf(void *buf) {
+  strcpy(buf,"result");
+  return 7;
+}
+
+static int t_join_result(void) {
+  void *buf;
+  char *r;
+  int status;
+  tid_t t;
+
+  lwp_start();
+  t = lwp_create_ex(fillbuf,64,&buf,0);
+  lwp_create(exitwith,(void*)3,0);
+
+  /* lwp_wait gets the plain thread but must leave the other alone */
+  CHECK(lwp_wait(&status) != NO_THREAD);
+  CHECK(LWPTERMSTAT(status) == 3);
+  CHECK(lwp_wait(&status) == NO_THREAD);
+
+  r = lwp_join_result(t,&status);
+  CHECK(r == buf);
+  CHECK(!strcmp(r,"result"));
+  CHECK(LWPTERMSTAT(status) == 7);
+  lwp_result_free(r);
+  return 0;
+}
+
+/* each joiner should only be woken by the thread it joins, not by every
+ * exit along the way; wakeups are counted as admits to the scheduler */
+#define JOINERS 32
+
+static tid_t targets[JOINERS];
+static struct scheduler counting;
+static void (*real_admit)(thread);
+static int admits;
+
+static void count_admit(thread new) {
+  admits++;
+  real_admit(new);
+}
+
+/* yield as many times as buf says, so the targets exit one per round */
+static int yieldfor(void *buf) {
+  long i;
+  for(i=0;i<*(long *)buf;i++)
+    lwp_yield();
+  return 0;
+}
+
+static int joiner(void *arg) {
+  int status;
+  lwp_result_free(lwp_join_result(targets[(long)arg],&status));
+  return 0;
+}
+
+static int t_many_joiners(void) {
+  void *buf;
+  long i;
+  int sum;
+  lwp_set_scheduler(NULL);       /* the default, so we can wrap it */
+  counting = *lwp_get_scheduler();
+  counting.init = NULL;
+  real_admit = counting.admit;
+  counting.admit = count_admit;
+  lwp_set_scheduler(&counting);
+
+  for(i=0;i<JOINERS;i++) {
+    targets[i] = lwp_create_ex(yieldfor,sizeof(long),&buf,0);
+    *(long *)buf = i + 1;
+  }
+  for(i=0;i<JOINERS;i++)
+    lwp_create(joiner,(void*)i,0);
+  lwp_start();
+  CHECK(waitall(&sum) == JOINERS);
+  /* creating 2*JOINERS threads, one wakeup per joiner and at most one
+   * per exit for ourselves in lwp_wait; waking everyone is O(JOINERS^2) */
+  CHECK(admits <= 6 * JOINERS);
+  return 0;
+}
+
+/* ---------------------------------------------------------------- */
+/* stop and restart                                                 */
+
+static int stopped;
+
+static int stopper(void *arg) {
+  stopped = 1;
+  lwp_stop();
+  return 1;
+}
+
+static int t_stop_restart(void) {
+  int i, sum;
+  lwp_start();
+  lwp_create(stopper,NULL,0);
+  lwp_create(exitwith,(void*)2,0);
+  for(i=0;i<3 && !stopped;i++)   /* we may be picked again first */
+    lwp_yield();                 /* comes back here on lwp_stop */
+  CHECK(stopped);
+  lwp_start();
+  CHECK(waitall(&sum) == 2);
+  CHECK(sum == 3);
+  return 0;
+}
+
+static int t_park_stop(void) {
+  int sum;
+  lwp_start();
+  lwp_create(stopper,NULL,0);
+  lwp_park();                    /* woken by lwp_stop, not a post */
+  CHECK(stopped);
+  lwp_start();
+  CHECK(waitall(&sum) == 1);
+  return 0;
+}
+
+/* ---------------------------------------------------------------- */
+/* park and post                                                    */
+
+static int parker(void *arg) {
+  lwp_park();
+  return 5;
+}
+
+static int t_park_post(void) {
+  int sum;
+  tid_t t;
+  lwp_start();
+  t = lwp_create(parker,NULL,0);
+  lwp_yield();                   /* let it park */
+  CHECK(lwp_post(t) == 0);
+  CHECK(waitall(&sum) == 1);
+  CHECK(sum == 5);
+
+  /* a post ahead of the park leaves a permit behind */
+  t = lwp_create(parker,NULL,0);
+  CHECK(lwp_post(t) == 0);
+  CHECK(waitall(&sum) == 1);
+  return 0;
+}
+
+static tid_t foreign_target;
+
+static void *foreign_poster(void *arg) {
+  usleep(20000);
+  lwp_post(foreign_target);
+  return NULL;
+}
+
+static int t_post_foreign(void) {
+  pthread_t pt;
+  int sum;
+  lwp_start();
+  foreign_target = lwp_create(parker,NULL,0);
+  CHECK(pthread_create(&pt,NULL,foreign_poster,NULL) == 0);
+  CHECK(waitall(&sum) == 1);     /* idles until the post arrives */
+  pthread_join(pt,NULL);
+  return 0;
+}
+
+static void *foreign_submitter(void *arg) {
+  usleep(20000);
+  lwp_submit(exitwith,(void*)9);
+  return NULL;
+}
+
+static int t_submit(void) {
+  pthread_t pt;
+  int status;
+  lwp_start();
+  lwp_create(parker,NULL,0);     /* keeps the runtime from giving up */
+  CHECK(pthread_create(&pt,NULL,foreign_submitter,NULL) == 0);
+  CHECK(lwp_wait(&status) != NO_THREAD);
+  CHECK(LWPTERMSTAT(status) == 9);
+  pthread_join(pt,NULL);
+  return 0;
+}
+
+/* ---------------------------------------------------------------- */
+/* task groups                                                      */
+
+static int group_of(int n) {
+  lwp_group_t g;
+  int i, *statuses;
+  void **args;
+
+  statuses = malloc(n * sizeof(int));
+  args = malloc(n * sizeof(void *));
+  for(i=0;i<n;i++)
+    args[i] = (void*)(long)(i & 0xff);
+
+  lwp_start();
+  g = lwp_group_create();
+  CHECK(lwp_group_spawn_n(g,exitwith,args,n) == n);
+  CHECK(lwp_group_join_all(g,statuses) == n);
+  for(i=0;i<n;i++)
+    CHECK(LWPTERMSTAT(statuses[i]) == (i & 0xff));
+  CHECK(lwp_wait(NULL) == NO_THREAD);
+  lwp_group_destroy(g);
+  free(args);
+  free(statuses);
+  return 0;
+}
+
+static int t_group(void) {
+  return group_of(100);
+}
+
+static int t_group_many(void) {
+  return group_of(4000);         /* 8MB stacks each */
+}
+
+/* a member stops the runtime while we are joining in destroy */
+static int t_group_stop(void) {
+  lwp_group_t g;
+  void *args[1] = {NULL};
+  int sum;
+  lwp_start();
+  g = lwp_group_create();
+  CHECK(lwp_group_spawn_n(g,stopper,args,1) == 1);
+  CHECK(lwp_group_destroy(g) == -1);
+  CHECK(stopped);
+  lwp_start();
+  CHECK(lwp_group_destroy(g) == 0);
+  CHECK(waitall(&sum) == 0);
+  return 0;
+}
+
+/* ---------------------------------------------------------------- */
+/* stack modes                                                      */
+
+static int recurse(int depth) {
+  volatile char pad[1024];
+  pad[0] = depth;
+  if ( depth )
+    return recurse(depth - 1) + pad[0];
+  return 0;
+}
+
+static size_t grown;
+
+static int deepcall(void *arg) {
+  recurse((int)(long)arg);
+  grown = tid2thread(lwp_gettid())->stack_hwm;
+  return 0;
+}
+
+static int t_growable(void) {
+  int sum;
+  lwp_set_growable_stacks(1);
+  lwp_create(deepcall,(void*)1000,0);   /* about 1MB deep */
+  lwp_start();
+  CHECK(waitall(&sum) == 1);
+  CHECK(grown >= 1000*1024);
+  return 0;
+}
+
+static size_t lastsize;
+
+static int shallow(void *arg) {
+  lastsize = tid2thread(lwp_gettid())->stacksize;
+  return 0;
+}
+
+static int t_adaptive(void) {
+  size_t first;
+  int i, sum;
+  lwp_set_stack_profiling(LWP_STACKPROF_ADAPT);
+  lwp_start();
+  lwp_create(shallow,NULL,0);
+  CHECK(waitall(&sum) == 1);
+  first = lastsize;
+  for(i=0;i<20;i++) {
+    lwp_create(shallow,NULL,0);
+    CHECK(waitall(&sum) == 1);
+  }
+  CHECK(lastsize < first);
+  CHECK(report_space() == 0);    /* the profile is the library's own */
+  return 0;
+}
+
+/* how far below here the stack stays readable: each page is handed to
+ * write(2), which fails with EFAULT where touching it would fault */
+static long readable_below(void) {
+  long page = sysconf(_SC_PAGE_SIZE);
+  char here, c, *p = (char *)((unsigned long)&here & ~(page - 1));
+  int fds[2];
+  if ( pipe(fds) )
+    return -1;
+  while ( write(fds[1],p - page,1) == 1 && read(fds[0],&c,1) == 1 )
+    p -= page;
+  close(fds[0]);
+  close(fds[1]);
+  return &here - p;
+}
+
+static long below[4];
+
+static int probe(void *arg) {
+  below[(long)arg] = readable_below();
+  return 0;
+}
+
+static int t_placement(void) {
+  int i, sum;
+  lwp_set_stack_placement(LWP_PLACE_HUGE | LWP_PLACE_NUMA);
+  for(i=1;i<=20;i++)
+    lwp_create(taketurns,(void*)(long)(i % 3),0);
+  lwp_start();
+  CHECK(waitall(&sum) == 20);
+
+  /* stacks sit back to back, so without a guard page each one would
+   * run on into the one below and the later ones would read deeper */
+  for(i=0;i<4;i++)
+    lwp_create(probe,(void*)(long)i,0);
+  CHECK(waitall(&sum) == 4);
+  for(i=0;i<4;i++)
+    CHECK(below[i] > 0 && below[i] == below[0]);
+
+  /* contexts live on the stacks and arenas outside smartalloc */
+  CHECK(report_space() == 0);
+  return 0;
+}
+
+/* ---------------------------------------------------------------- */
+/* per-LWP state                                                    */
+
+static int dtor_calls;
+
+static void dtor(void *value) {
+  dtor_calls++;
+}
+
+static lwp_key_t key;
+
+static int usekey(void *arg) {
+  CHECK(lwp_getspecific(key) == NULL);
+  CHECK(lwp_setspecific(key,arg) == 0);
+  errno = (int)(long)arg;
+  lwp_yield();
+  CHECK(lwp_getspecific(key) == arg);
+  CHECK(errno == (int)(long)arg);
+  CHECK(lwp_arena_alloc(100) != NULL);
+  return 0;
+}
+
+static int t_specific(void) {
+  int sum;
+  CHECK(lwp_key_create(&key,dtor) == 0);
+  lwp_create(usekey,(void*)11,0);
+  lwp_create(usekey,(void*)12,0);
+  lwp_start();
+  CHECK(waitall(&sum) == 2);
+  CHECK(sum == 0);
+  CHECK(dtor_calls == 2);
+  CHECK(lwp_key_delete(key) == 0);
+  return 0;
+}
+
+static int t_stats(void) {
+  lwp_stats_t st;
+  tid_t t;
+  lwp_start();
+  t = lwp_create(taketurns,(void*)0,0);
+  lwp_yield();                   /* ourselves again, then t */
+  lwp_yield();
+  CHECK(lwp_stats(t,&st) == 0);
+  CHECK(st.tid == t);
+  CHECK(st.switches >= 1);
+  CHECK(lwp_stats_all(&st,1) == 2);
+  CHECK(lwp_stats(NO_THREAD,&st) == -1);
+  return 0;
+}
+
+/* ---------------------------------------------------------------- */
+/* watchdog: the runtime idles forever afterwards, so the alarm     */
+/* handler decides from what the watchdog wrote                     */
+
+static int wdpipe[2];
+static tid_t peer[2];
+
+static void wdcheck(int sig) {
+  static char buf[4096];
+  ssize_t n = read(wdpipe[0],buf,sizeof(buf)-1);
+  buf[n > 0 ? n : 0] = '\0';
+  _exit(strstr(buf,"deadlock: ") ? 0 : 1);
+}
+
+static int joinpeer(void *arg) {
+  lwp_yield();
+  lwp_join_result(peer[(long)arg],NULL);
+  return 0;
+}
+
+static int t_watchdog(void) {
+  CHECK(pipe(wdpipe) == 0);
+  fcntl(wdpipe[0],F_SETFL,O_NONBLOCK);
+  signal(SIGALRM,wdcheck);
+  alarm(1);
+  lwp_set_watchdog(wdpipe[1],0);
+  lwp_start();
+  peer[0] = lwp_create(joinpeer,(void*)1,0);
+  peer[1] = lwp_create(joinpeer,(void*)0,0);
+  lwp_join_result(peer[0],NULL);
+  return 1;                      /* not reached */
+}
+
+/* ---------------------------------------------------------------- */
+/* smartalloc, which liblwp carries along                           */
+
+static int t_smartalloc_track(void) {
+  char *m = mmap(NULL,8192,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  char *p;
+  CHECK(m != MAP_FAILED);
+  munmap(m,4096);                /* nothing mapped in front of it */
+  smartalloc_track(m+4096,64,0,0);
+  free(m+4096);
+  p = malloc(40);
+  CHECK(p != NULL);
+  free(p);
+  CHECK(report_space() == 0);
+  return 0;
+}
+
+/* The sampled stack has to start in the function that called malloc,
+ * so leaf_alloc notes where it will return to; mid keeps a frame of
+ * its own by doing something after the call.
+ */
+static int leaf_line, mid_calls;
+static void *leaf_pc[2];
+
+static __attribute__((noinline)) void *leaf_alloc(int n) {
+  void *p = malloc(n); leaf_line = __LINE__;
+  backtrace(leaf_pc,2);
+  return p;
+}
+
+static __attribute__((noinline)) void *mid(int n) {
+  void *p = leaf_alloc(n);
+  mid_calls++;
+  return p;
+}
+
+/* what fn wrote to a temporary file, in buf */
+static int capture(int (*fn)(int, int), int arg, char *buf, int len) {
+  FILE *f = tmpfile();
+  int n;
+  if ( !f )
+    return -1;
+  fn(fileno(f),arg);
+  lseek(fileno(f),0,SEEK_SET);
+  n = read(fileno(f),buf,len-1);
+  fclose(f);
+  buf[n > 0 ? n : 0] = '\0';
+  return n;
+}
+
+static int leak_report(int fd, int unused) {
+  return (int)smartalloc_leak_report(fd);
+}
+
+static int t_smartalloc_profile(void) {
+  static char buf[1<<16];
+  char site[64], *line;
+  void *p1, *p2, *p3, *a, *b;
+  unsigned long lb, lo, tb, to, bytes, blocks, owner;
+  int stacks = 0, rows = 0, leaks = 0;
+
+  smartalloc_set_sampling(1);    /* every allocation */
+  p1 = mid(48);
+  p2 = leaf_alloc(48);           /* another stack, same file:line */
+
+  /* pprof: one stack through mid, starting inside leaf_alloc */
+  CHECK(capture(smartalloc_write_profile,SMARTALLOC_PROFILE_PPROF,
+                buf,sizeof(buf)) > 0);
+  for(line=strtok(buf,"\n");line;line=strtok(NULL,"\n"))
+    if ( sscanf(line,"%*[^@]@ %p %p",&a,&b) == 2 && b == leaf_pc[1] ) {
+      CHECK((char *)a > (char *)leaf_pc[0] - 64 &&
+            (char *)a < (char *)leaf_pc[0] + 64);
+      stacks++;
+    }
+  CHECK(stacks == 1);
+
+  /* text: both stacks on a single row for the malloc line */
+  snprintf(site,sizeof(site),"lwptest.c:%d",leaf_line);
+  CHECK(capture(smartalloc_write_profile,SMARTALLOC_PROFILE_TEXT,
+                buf,sizeof(buf)) > 0);
+  for(line=strtok(buf,"\n");line;line=strtok(NULL,"\n"))
+    if ( strstr(line,site) ) {
+      CHECK(sscanf(line,"%lu %lu %lu %lu",&lb,&lo,&tb,&to) == 4);
+      CHECK(lo == 2 && lb == 96);
+      rows++;
+    }
+  CHECK(rows == 1);
+
+  /* without sampling the block is indexed and shows in the leak report */
+  smartalloc_set_sampling(0);
+  p3 = leaf_alloc(100);
+  CHECK(capture(leak_report,0,buf,sizeof(buf)) > 0);
+  for(line=strtok(buf,"\n");line;line=strtok(NULL,"\n"))
+    if ( strstr(line,site) &&
+         sscanf(line,"%lu %lu %lu",&bytes,&blocks,&owner) == 3 ) {
+      CHECK(bytes == 100 && blocks == 1);
+      leaks++;
+    }
+  CHECK(leaks == 1);
+
+  free(p1);
+  free(p2);
+  free(p3);
+  CHECK(mid_calls == 1);
+  CHECK(report_space() == 0);
+  return 0;
+}
+
+/* ---------------------------------------------------------------- */
+
+static struct testcase {
+  const char *name;
+  int (*run)(void);
+} cases[] = {
+  {"create_wait",     t_create_wait},
+  {"round_robin",     t_round_robin},
+  {"scheduler",       t_scheduler},
+  {"join_result",     t_join_result},
+  {"many_joiners",    t_many_joiners},
+  {"stop_restart",    t_stop_restart},
+  {"park_stop",       t_park_stop},
+  {"park_post",       t_park_post},
+  {"post_foreign",    t_post_foreign},
+  {"submit",          t_submit},
+  {"group",           t_group},
+  {"group_many",      t_group_many},
+  {"group_stop",      t_group_stop},
+  {"growable",        t_growable},
+  {"adaptive",        t_adaptive},
+  {"placement",       t_placement},
+  {"specific",        t_specific},
+  {"stats",           t_stats},
+  {"watchdog",        t_watchdog},
+  {"smartalloc_track",t_smartalloc_track},
+  {"smartalloc_profile",t_smartalloc_profile},
+};
+#define NCASES (sizeof(cases)/sizeof(cases[0]))
+
+static int runcase(struct testcase *c, int verbose) {
+  pid_t pid;
+  int status, devnull;
+
+  fflush(stdout);
+  if ( (pid = fork()) == -1 ) {
+    perror("fork");
+    return 1;
+  }
+  if ( pid == 0 ) {
+    if ( !verbose && (devnull = open("/dev/null",O_WRONLY)) != -1 )
+      dup2(devnull,2);
+    alarm(TIMEOUT);
+    _exit(c->run());
+  }
+  if ( waitpid(pid,&status,0) == -1 ) {
+    perror("waitpid");
+    return 1;
+  }
+  if ( WIFEXITED(status) && WEXITSTATUS(status) == 0 )
+    return 0;
+  if ( WIFSIGNALED(status) )
+    printf("    killed by signal %d%s\n",WTERMSIG(status),
+           WTERMSIG(status) == SIGALRM ? " (hung)" : "");
+  return 1;
+}
+
+int main(int argc, char *argv[]){
+  int i, verbose = 0, failed = 0, ran = 0;
+  size_t j;
+
+  if ( argc > 1 && !strcmp(argv[1],"-v") ) {
+    verbose = 1;
+    argc--;
+    argv++;
+  }
+
+  for(j=0;j<NCASES;j++) {
+    if ( argc > 1 ) {            /* only the ones asked for */
+      for(i=1;i<argc && strcmp(argv[i],cases[j].name);i++)
+        ;
+      if ( i == argc )
+        continue;
+    }
+    if ( runcase(&cases[j],verbose) ) {
+      printf("FAIL %s\n",cases[j].name);
+      failed++;
+    } else {
+      printf("ok   %s\n",cases[j].name);
+    }
+    ran++;
+  }
+
+  printf("%d/%d passed\n",ran-failed,ran);
+  return failed ? 1 : 0;
+}
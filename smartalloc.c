@@ -35,146 +35,624 @@
 #include <unistd.h>
 #include <assert.h>
 #include <pthread.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#include <signal.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #define PATTERN 0xA
 #define MARGIN 16
-#define HASH_SIZE	113
-#define smartalloc_hash(x) ( ((unsigned long)(x)) % HASH_SIZE )
+#define HASH_SIZE	128		/* initial bucket count, doubles as it fills */
+#define STRIPES	16		/* bucket locks; a bucket's lock is hash % STRIPES */
+#define smartalloc_hash(x) ( (((unsigned long)(x) >> 4) * 0x9E3779B97F4A7C15UL) >> 20 )
+#define SITE_DEPTH	32		/* frames kept per sampled call stack */
+#define SITE_SKIP	6		/* most of our own frames above the caller */
+#define SITE_HASH	1024
+#define MAG_CLASSES	9		/* cached data sizes 16, 32, ... 4096 */
+#define MAG_SIZE	32		/* blocks cached per class per thread */
+#define NO_CLASS	0xff
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-static pthread_mutex_t mutt = PTHREAD_MUTEX_INITIALIZER;
+/* Everything not static here is the smartalloc.h API, which has to stay
+ * visible when the library is built with -fvisibility=hidden.
+ */
+#pragma GCC visibility push(default)
 
+/* One call stack that sampled allocations came from.  live_* follow the
+ * sampled blocks still outstanding, total_* everything ever sampled.
+ */
+typedef struct alloc_site {
+   const char *file;
+   int line;
+   int depth;
+   void *pc[SITE_DEPTH];
+   unsigned long live_objs, live_bytes;
+   unsigned long total_objs, total_bytes;
+   struct alloc_site *next;
+} alloc_site;
+
+/* Blocks from smartalloc carry their track_t in the prefix in front of
+ * the leading margin: size, call site and a canary keyed to the header's
+ * own address, which freeing checks in O(1).  The hash index is for the
+ * leak report and for memory handed to smartalloc_track from outside
+ * (with a separately malloc'd node); take() says when freeing has to
+ * search it.
+ */
 typedef struct track_t {
+   unsigned long magic;
    char *data;
    unsigned long space;
+   const char *file;
+   int line;
    unsigned char needs_free;
+   unsigned char embedded;
    unsigned short margin;
+   unsigned char indexed;
+   unsigned char klass;		/* magazine size class, or NO_CLASS */
+   unsigned long capacity;	/* data bytes the block can hold */
+   alloc_site *site;
+   unsigned long owner;		/* from the owner hook, 0 if none */
    struct track_t *next;
+   struct track_t **pprev;
 } track_t, *track_t_ptr;
 
-static track_t_ptr track_hash[HASH_SIZE];
+#define HDR_SIZE ((sizeof(track_t) + 15) & ~15UL)
+#define LIVE_MAGIC 0x5AFEA110CA7EDUL
+#define FREED_MAGIC 0xDEADUL
+#define live_magic(t) ( LIVE_MAGIC ^ (unsigned long)(t) )
+
+/* In sampling mode only the profile is kept, so embedded blocks skip
+ * the index just as they do under SMARTALLOC_NO_INDEX.
+ */
+#ifdef SMARTALLOC_NO_INDEX
+#define index_embedded() 0
+#else
+#define index_embedded() ( sample_mean == 0 )
+#endif
+
+#define POISON_HEAD 64		/* bytes poisoned by a lazy free */
+
+/* same values as smartalloc.h, which can't be included here */
+#define SMARTALLOC_POISON_FULL    0
+#define SMARTALLOC_POISON_LAZY    1
+#define SMARTALLOC_POISON_SAMPLED 2
+
+/* same values as smartalloc.h */
+#define SMARTALLOC_PROFILE_PPROF  0
+#define SMARTALLOC_PROFILE_TEXT   1
+
+static unsigned long sample_mean = 0;	/* mean bytes between samples */
+static __thread long sample_left;
+static __thread unsigned long sample_rng;
+static alloc_site *site_hash[SITE_HASH];
+static pthread_mutex_t site_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Each kernel thread keeps small freed blocks, already checked and
+ * poisoned, in per-class magazines and hands them straight back out, so
+ * the hot path touches no shared state but the atomic counters.  Build
+ * with SMARTALLOC_NO_MAGAZINES to give every block back to libc.
+ */
+typedef struct magazine {
+   int count[MAG_CLASSES];
+   track_t *slot[MAG_CLASSES][MAG_SIZE];
+   int registered;
+} magazine;
+
+static __thread magazine mag;
+static pthread_key_t mag_key;
+
+static unsigned long (*owner_fn)(void);
+static volatile sig_atomic_t report_pending = 0;
+
+static int poison_mode = SMARTALLOC_POISON_FULL;
+static unsigned long poison_every = 1;
+static unsigned long poison_count = 0;
+
+static pthread_mutex_t stripe_lock[STRIPES];
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static track_t_ptr *track_hash;
+static unsigned long hash_size;
+static unsigned long tracked = 0;
 static unsigned long allocated = 0;
-static int inited = 0;
+static int foreign = 0;		/* live smartalloc_track regions */
+static int unindexed_embeds = 0;	/* some blocks are only found in-band */
+
+unsigned long smartalloc_leak_report(int fd);
 
 static void completion_function(void)
 {
 	if (allocated == 0)
 		return;
 	fprintf(stderr, "%lu bytes left unfreed at end of program!\n", allocated);
+	smartalloc_leak_report(2);
+}
+
+static void mag_flush(void *arg)
+{
+   magazine *m = (magazine *) arg;
+   int k;
+
+   for (k = 0; k < MAG_CLASSES; k++)
+      while (m->count[k] > 0)
+         free(m->slot[k][--m->count[k]]);
+   m->registered = 0;
+}
+
+static void smartalloc_init(void)
+{
+   int i;
+
+   pthread_key_create(&mag_key, mag_flush);
+   for (i = 0; i < STRIPES; i++)
+      pthread_mutex_init(&stripe_lock[i], NULL);
+   hash_size = HASH_SIZE;
+   if ((track_hash = (track_t_ptr *) calloc(hash_size, sizeof(track_t_ptr))) == NULL) {
+      fprintf(stderr, "Malloc failure in in smartalloc\n");
+      exit(1);
+   }
+   atexit(completion_function);
+}
+
+static void link_node(track_t_ptr *bucket, track_t *temp)
+{
+   temp->next = *bucket;
+   temp->pprev = bucket;
+   if (*bucket)
+      (*bucket)->pprev = &temp->next;
+   *bucket = temp;
+}
+
+/* Double the table once it averages two nodes per bucket.  Taking every
+ * stripe in order keeps it safe against concurrent inserts and removes;
+ * hash_size only changes here, so holding any one stripe is enough to
+ * read it.  tracked moves outside the locks and is only read atomically.
+ */
+static void grow_table(void)
+{
+   track_t_ptr *new_hash, temp, next;
+   unsigned long i, new_size;
+
+   for (i = 0; i < STRIPES; i++)
+      pthread_mutex_lock(&stripe_lock[i]);
+
+   if (__atomic_load_n(&tracked, __ATOMIC_RELAXED) > 2 * hash_size) {
+      new_size = 2 * hash_size;
+      if ((new_hash = (track_t_ptr *) calloc(new_size, sizeof(track_t_ptr))) != NULL) {
+         for (i = 0; i < hash_size; i++)
+            for (temp = track_hash[i]; temp != NULL; temp = next) {
+               next = temp->next;
+               link_node(&new_hash[smartalloc_hash(temp->data) & (new_size - 1)], temp);
+            }
+         free(track_hash);
+         track_hash = new_hash;
+         hash_size = new_size;
+      }
+   }
+
+   for (i = STRIPES; i-- > 0; )
+      pthread_mutex_unlock(&stripe_lock[i]);
+}
+
+static void track_insert(track_t *temp)
+{
+   unsigned long h = smartalloc_hash(temp->data);
+   unsigned long size;
+
+   pthread_once(&init_once, smartalloc_init);
+   temp->magic = live_magic(temp);
+   __atomic_add_fetch(&allocated, temp->space, __ATOMIC_RELAXED);
+   if (temp->site) {
+      __atomic_add_fetch(&temp->site->live_objs, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&temp->site->live_bytes, temp->space, __ATOMIC_RELAXED);
+   }
+   if (!temp->indexed)
+      return;
+   if (!temp->embedded)
+      __atomic_add_fetch(&foreign, 1, __ATOMIC_RELAXED);
+
+   pthread_mutex_lock(&stripe_lock[h % STRIPES]);
+   size = hash_size;
+   link_node(&track_hash[h & (size - 1)], temp);
+   pthread_mutex_unlock(&stripe_lock[h % STRIPES]);
+
+   /* a stale size only means an extra look under the locks */
+   if (__atomic_add_fetch(&tracked, 1, __ATOMIC_RELAXED) > 2 * size)
+      grow_table();
+}
+
+static void track_unlink(track_t *temp)
+{
+   unsigned long h = smartalloc_hash(temp->data);
+
+   __atomic_sub_fetch(&allocated, temp->space, __ATOMIC_RELAXED);
+   if (temp->site) {
+      __atomic_sub_fetch(&temp->site->live_objs, 1, __ATOMIC_RELAXED);
+      __atomic_sub_fetch(&temp->site->live_bytes, temp->space, __ATOMIC_RELAXED);
+   }
+   if (!temp->indexed)
+      return;
+
+   pthread_mutex_lock(&stripe_lock[h % STRIPES]);
+   *temp->pprev = temp->next;
+   if (temp->next)
+      temp->next->pprev = temp->pprev;
+   pthread_mutex_unlock(&stripe_lock[h % STRIPES]);
+   __atomic_sub_fetch(&tracked, 1, __ATOMIC_RELAXED);
+   if (!temp->embedded)
+      __atomic_sub_fetch(&foreign, 1, __ATOMIC_RELAXED);
 }
 
 void smartalloc_track(char *data, unsigned long space, unsigned char needs_free, unsigned short margin)
 {
    track_t *temp;
 
-   if (inited == 0) {
-      atexit(completion_function);
-	  memset(track_hash, 0, sizeof(track_hash));
-	  inited = 1;
-   }
    if ((temp = (track_t *) malloc(sizeof(track_t))) == NULL)
    {
       fprintf(stderr, "Malloc failure in in smartalloc\n");
       exit(1);
    }
 
-   pthread_mutex_lock(&mutt);
-   allocated += space;
    temp->needs_free = needs_free;
+   temp->embedded = 0;
+   temp->klass = NO_CLASS;
+   temp->capacity = space;
+   temp->indexed = 1;
+   temp->site = NULL;
    temp->data = data;
    temp->space = space;
    temp->margin = margin;
-   temp->next = track_hash[smartalloc_hash(data)];
-   track_hash[smartalloc_hash(data)] = temp;
-   pthread_mutex_unlock(&mutt);
+   temp->file = NULL;
+   temp->line = 0;
+   temp->owner = owner_fn ? owner_fn() : 0;
+   track_insert(temp);
 }
 
-void *smartalloc(unsigned long bytes, char *file, int line, char fill)
+/* Bytes until the next sample, drawn from an exponential distribution
+ * with mean sample_mean so the samples form a Poisson process over bytes
+ * allocated.  -ln(u) is worked out by hand to keep libm out of the link.
+ */
+static long sample_interval(void)
 {
-   char *data;
+   union { double d; unsigned long i; } v;
+   double t, t2, ln;
+   int e;
+
+   if (sample_rng == 0)
+      sample_rng = ((unsigned long)&sample_rng ^ (unsigned long)getpid()) *
+       0x9E3779B97F4A7C15UL | 1;
+   sample_rng ^= sample_rng << 13;
+   sample_rng ^= sample_rng >> 7;
+   sample_rng ^= sample_rng << 17;
+
+   /* u in (0,1) as m * 2^e with m in [1,2); ln m from its atanh series */
+   v.d = ((sample_rng >> 11) + 0.5) / 9007199254740992.0;
+   e = (int)((v.i >> 52) & 0x7ff) - 1023;
+   v.i = (v.i & 0xfffffffffffffUL) | 0x3ff0000000000000UL;
+   t = (v.d - 1) / (v.d + 1);
+   t2 = t * t;
+   ln = e * 0.6931471805599453 + 2 * t * (1 + t2 * (1.0/3 + t2 * (1.0/5 + t2 / 7)));
+
+   return (long)(-ln * sample_mean) + 1;
+}
 
-   if ( (data = (char *)malloc(bytes + 2*MARGIN)) == NULL) {
-      fprintf(stderr, "Malloc failure in file %s on line %d\n", file, line);
-      exit(1);
+/* Find or make the site for the current call stack.  The stack starts
+ * at caller, the return address the public entry point was called with:
+ * how many of our own frames sit above it depends on inlining and tail
+ * calls, so it is looked for rather than counted.
+ */
+static __attribute__((noinline)) alloc_site *sample_site(const char *file,
+ int line, void *caller)
+{
+   void *pc[SITE_DEPTH + SITE_SKIP];
+   unsigned long h = line;
+   alloc_site *site;
+   int depth, skip, i;
+
+   depth = backtrace(pc, SITE_DEPTH + SITE_SKIP);
+   for (skip = 0; skip < depth && skip < SITE_SKIP; skip++)
+      if (pc[skip] == caller)
+         break;
+   if (skip == depth || skip == SITE_SKIP)
+      skip = 0;
+   if ((depth -= skip) > SITE_DEPTH)
+      depth = SITE_DEPTH;
+   for (i = 0; i < depth; i++)
+      h = (h ^ (unsigned long)pc[skip + i]) * 0x100000001B3UL;
+   h = smartalloc_hash(h) % SITE_HASH;
+
+   pthread_mutex_lock(&site_lock);
+   for (site = site_hash[h]; site != NULL; site = site->next)
+      if (site->line == line && site->file == file && site->depth == depth &&
+       !memcmp(site->pc, pc + skip, depth * sizeof(void *)))
+         break;
+   if (site == NULL && (site = (alloc_site *) calloc(1, sizeof(alloc_site))) != NULL) {
+      site->file = file;
+      site->line = line;
+      site->depth = depth;
+      memcpy(site->pc, pc + skip, depth * sizeof(void *));
+      site->next = site_hash[h];
+      site_hash[h] = site;
+   }
+   pthread_mutex_unlock(&site_lock);
+   return site;
+}
+
+/* Charge bytes against this thread's countdown; the allocation that
+ * runs it out is sampled.
+ */
+static __attribute__((noinline)) alloc_site *sample(unsigned long bytes,
+ const char *file, int line, void *caller)
+{
+   alloc_site *site;
+
+   if (sample_mean == 0)
+      return NULL;
+   if (sample_rng == 0)
+      sample_left = sample_interval();
+   if ((sample_left -= (long)bytes) > 0)
+      return NULL;
+   sample_left = sample_interval();
+
+   if ((site = sample_site(file, line, caller)) != NULL) {
+      __atomic_add_fetch(&site->total_objs, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&site->total_bytes, bytes, __ATOMIC_RELAXED);
    }
-   data += MARGIN;
+   return site;
+}
+
+void smartalloc_set_sampling(unsigned long mean_bytes)
+{
+   sample_mean = mean_bytes;
+}
+
+static unsigned size_class(unsigned long bytes)
+{
+#ifdef SMARTALLOC_NO_MAGAZINES
+   return NO_CLASS;
+#else
+   unsigned k = bytes <= 16 ? 0 : 60 - __builtin_clzl(bytes - 1);
 
-   memset(data, fill, bytes);
+   return k < MAG_CLASSES ? k : NO_CLASS;
+#endif
+}
+
+static char *mag_get(unsigned klass)
+{
+   if (klass == NO_CLASS || mag.count[klass] == 0)
+      return NULL;
+   return (char *) mag.slot[klass][--mag.count[klass]];
+}
+
+static int mag_put(track_t *temp)
+{
+   unsigned klass = temp->klass;
+
+   if (klass == NO_CLASS || mag.count[klass] == MAG_SIZE)
+      return 0;
+   if (!mag.registered) {
+      /* the key's destructor hands the blocks back when the thread exits */
+      pthread_once(&init_once, smartalloc_init);
+      pthread_setspecific(mag_key, &mag);
+      mag.registered = 1;
+   }
+   mag.slot[klass][mag.count[klass]++] = temp;
+   return 1;
+}
+
+/* Lay out header, margins and fill for a raw block of HDR_SIZE + bytes +
+ * 2*MARGIN and start tracking it.  Sampling mode skips the garbage fill
+ * but never calloc's zeroing.
+ */
+static __attribute__((noinline)) char *embed(char *raw, unsigned long bytes,
+ const char *file, int line, char fill, void *caller)
+{
+   track_t *temp = (track_t *) raw;
+   char *data = raw + HDR_SIZE + MARGIN;
+
+   if (fill == 0 || sample_mean == 0)
+      memset(data, fill, bytes);
    memset(data-MARGIN, PATTERN, MARGIN);
    memset(data+bytes, PATTERN, MARGIN);
-   smartalloc_track(data, bytes, 1, MARGIN);
+
+   temp->needs_free = 1;
+   temp->embedded = 1;
+   temp->indexed = index_embedded();
+   if (!temp->indexed && !__atomic_load_n(&unindexed_embeds, __ATOMIC_RELAXED))
+      __atomic_store_n(&unindexed_embeds, 1, __ATOMIC_RELAXED);
+   temp->site = sample(bytes, file, line, caller);
+   temp->data = data;
+   temp->space = bytes;
+   temp->margin = MARGIN;
+   temp->file = file;
+   temp->line = line;
+   temp->owner = owner_fn ? owner_fn() : 0;
+   track_insert(temp);
 
    return data;
 }
 
-void *smartvalloc(unsigned long bytes, char *file, int line, char fill)
+static void *alloc_block(unsigned long bytes, const char *file, int line,
+ char fill, void *caller)
 {
-   char *data;
+   unsigned klass = size_class(bytes);
+   unsigned long cap = klass == NO_CLASS ? bytes : 16UL << klass;
+   char *raw;
 
-   if ( (data = (char *)valloc(bytes + 2*MARGIN)) == NULL) {
+   if (report_pending) {
+      report_pending = 0;
+      smartalloc_leak_report(2);
+   }
+
+   if ( (raw = mag_get(klass)) == NULL &&
+    (raw = (char *)malloc(HDR_SIZE + cap + 2*MARGIN)) == NULL) {
       fprintf(stderr, "Malloc failure in file %s on line %d\n", file, line);
       exit(1);
    }
-   data += MARGIN;
 
-   memset(data, fill, bytes);
-   memset(data-MARGIN, PATTERN, MARGIN);
-   memset(data+bytes, PATTERN, MARGIN);
-   smartalloc_track(data, bytes, 1, MARGIN);
+   ((track_t *) raw)->klass = klass;
+   ((track_t *) raw)->capacity = cap;
+   return embed(raw, bytes, file, line, fill, caller);
+}
 
-   return data;
+/* The entry points stay out of line so that their return address is in
+ * the code that asked for the memory, which is where sampled stacks begin.
+ */
+__attribute__((noinline))
+void *smartalloc(unsigned long bytes, const char *file, int line, char fill)
+{
+   return alloc_block(bytes, file, line, fill, __builtin_return_address(0));
+}
+
+__attribute__((noinline))
+void *smartvalloc(unsigned long bytes, const char *file, int line, char fill)
+{
+   char *raw;
+
+   if ( (raw = (char *)valloc(HDR_SIZE + bytes + 2*MARGIN)) == NULL) {
+      fprintf(stderr, "Malloc failure in file %s on line %d\n", file, line);
+      exit(1);
+   }
+
+   ((track_t *) raw)->klass = NO_CLASS;
+   ((track_t *) raw)->capacity = bytes;
+   return embed(raw, bytes, file, line, fill, __builtin_return_address(0));
 }
 
-track_t *removeTrackNode(void *address)
+/* Search the index; only needed for memory smartalloc_track was given. */
+static track_t *removeTrackNode(void *address)
 {
-   track_t *temp, *to_free;
+   track_t *temp;
+   unsigned long h = smartalloc_hash(address);
+   unsigned long expect;
 
-   if (track_hash[smartalloc_hash(address)] == NULL)
+   pthread_once(&init_once, smartalloc_init);
+   pthread_mutex_lock(&stripe_lock[h % STRIPES]);
+   for (temp = track_hash[h & (hash_size - 1)]; temp != NULL; temp = temp->next)
+      if (temp->data == address)
+         break;
+   if (temp != NULL)
+      expect = live_magic(temp);
+   if (temp == NULL || !__atomic_compare_exchange_n(&temp->magic, &expect,
+    FREED_MAGIC, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      pthread_mutex_unlock(&stripe_lock[h % STRIPES]);
       return NULL;
+   }
+   pthread_mutex_unlock(&stripe_lock[h % STRIPES]);
 
-   pthread_mutex_lock(&mutt);
-   if (track_hash[smartalloc_hash(address)]->data == address) {
-      to_free = track_hash[smartalloc_hash(address)];
-      track_hash[smartalloc_hash(address)] = track_hash[smartalloc_hash(address)]->next;
-   } 
-   else {
-      for (temp = track_hash[smartalloc_hash(address)]; temp->next != NULL && temp->next->data != address;)
-         temp = temp->next;
-      if (temp->next == NULL) {
-		   pthread_mutex_unlock(&mutt);
-         return NULL;
+   track_unlink(temp);
+   return temp;
+}
+
+/* Claim the block at address for freeing by swapping its header canary,
+ * which also stops a concurrent double free.  The prefix in front of a
+ * smartalloc_track region need not be readable, so while any of those are
+ * live the index is searched first.  So it is when the header would sit
+ * on the page before address, which a stray pointer may not have mapped;
+ * that is a few percent of frees.
+ */
+static track_t *take(void *address)
+{
+   track_t *temp;
+   unsigned long expect;
+
+   if (__atomic_load_n(&foreign, __ATOMIC_RELAXED) ||
+    ((unsigned long)address & 4095) < MARGIN + HDR_SIZE) {
+      if ((temp = removeTrackNode(address)) != NULL ||
+       !__atomic_load_n(&unindexed_embeds, __ATOMIC_RELAXED))
+         return temp;
+   }
+
+   temp = (track_t *)((char *)address - MARGIN - HDR_SIZE);
+   if (((unsigned long)address & 15) == 0) {
+      expect = live_magic(temp);
+      if (temp->magic == expect && temp->data == address &&
+       __atomic_compare_exchange_n(&temp->magic, &expect, FREED_MAGIC, 0,
+       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+         track_unlink(temp);
+         return temp;
       }
-      to_free = temp->next;
-      temp->next = to_free->next;
    }
-   allocated -= to_free->space;
-   pthread_mutex_unlock(&mutt);
+   return NULL;
+}
 
-   return to_free;
+/* Give back the memory behind a node that is no longer tracked. */
+static void release(track_t *to_free)
+{
+   if (to_free->embedded) {
+      if (!mag_put(to_free))
+         free(to_free);
+   }
+   else {
+      if (to_free->needs_free)
+         free(to_free->data - to_free->margin);
+      free(to_free);
+   }
 }
 
-void freechecks(track_t *check, char *file, int line)
+/* Compare len guard bytes against PATTERN a vector at a time. */
+static int margin_intact(const char *p, unsigned short len)
 {
-   int i;
-   for (i = 0; i < check->margin; i++)
-      if (check->data[check->space + i] != PATTERN ||
-       check->data[-check->margin + i] != PATTERN) {
-         fprintf(stderr, 
-          "Space freed in file %s at line %d has data written past bounds.\n",
-          file, line);
-         break;
-      }
-   memset(check->data, PATTERN, check->space);
+   int i = 0;
+#ifdef __AVX2__
+   const __m256i pat32 = _mm256_set1_epi8(PATTERN);
+   for (; i + 32 <= len; i += 32)
+      if ((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+       _mm256_loadu_si256((const __m256i *)(p + i)), pat32)) != 0xFFFFFFFFu)
+         return 0;
+#endif
+#ifdef __SSE2__
+   const __m128i pat16 = _mm_set1_epi8(PATTERN);
+   for (; i + 16 <= len; i += 16)
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(
+       _mm_loadu_si128((const __m128i *)(p + i)), pat16)) != 0xFFFF)
+         return 0;
+#endif
+   for (; i < len; i++)
+      if (p[i] != PATTERN)
+         return 0;
+   return 1;
+}
+
+void smartalloc_set_poison(int mode, unsigned long every)
+{
+   poison_mode = mode;
+   poison_every = every ? every : 1;
 }
 
-void smartfree(void *address, char *file, int line)
+static void freechecks(track_t *check, const char *file, int line)
+{
+   unsigned long len = check->space;
+
+   if (!margin_intact(check->data + check->space, check->margin) ||
+    !margin_intact(check->data - check->margin, check->margin))
+      fprintf(stderr, 
+       "Space freed in file %s at line %d has data written past bounds.\n",
+       file, line);
+
+   /* lazy frees only spoil the head of the block, where stale pointers
+    * and lengths usually live; sampled mode still spoils every Nth fully
+    */
+   if (poison_mode == SMARTALLOC_POISON_LAZY ||
+    (poison_mode == SMARTALLOC_POISON_SAMPLED &&
+    __atomic_add_fetch(&poison_count, 1, __ATOMIC_RELAXED) % poison_every)) {
+      if (len > POISON_HEAD)
+         len = POISON_HEAD;
+   }
+   memset(check->data, PATTERN, len);
+}
+
+void smartfree(void *address, const char *file, int line)
 {
    track_t *to_free;
 
-   to_free = removeTrackNode(address);
+   to_free = take(address);
    if (NULL == to_free) {
       fprintf(stderr, 
        "Attempt to free non-malloced space in file %s at line %d\n",
@@ -183,24 +661,22 @@ void smartfree(void *address, char *file, int line)
    }
 
    freechecks(to_free, file, line);
-   if (to_free->needs_free)
-      free(to_free->data - to_free->margin);
-
-   free(to_free);
+   release(to_free);
 }
 
+__attribute__((noinline))
 void* smartrealloc(void* ptr, unsigned long newSize, int freeOnFailure,
-      char *file, int line, char fill)
+      const char *file, int line, char fill)
 {
    track_t *to_free;
-   int limit;
+   unsigned long limit;
    void *newMem;
-   char *s, *d;
 
    if (!ptr)
-      return smartalloc(newSize, file, line, fill);
+      return alloc_block(newSize, file, line, fill,
+       __builtin_return_address(0));
 
-   to_free = removeTrackNode(ptr);
+   to_free = take(ptr);
    if (NULL == to_free) {
       fprintf(stderr, 
        "Attempt to free non-malloced space in file %s at line %d\n",
@@ -208,30 +684,23 @@ void* smartrealloc(void* ptr, unsigned long newSize, int freeOnFailure,
       return NULL;
    }
 
-   newMem = smartalloc(newSize, file, line, fill);
+   newMem = alloc_block(newSize, file, line, fill, __builtin_return_address(0));
    if (NULL == newMem) {
       if (freeOnFailure) {
          freechecks(to_free, file, line);
-         if (to_free->needs_free)
-            free(to_free->data - to_free->margin);
+         release(to_free);
       }
       else
-         smartalloc_track(ptr, to_free->space, to_free->needs_free, MARGIN);
+         track_insert(to_free);
 
-      free(to_free);
       return NULL;
    }
 
    limit = newSize < to_free->space ? newSize : to_free->space;
-   s = (char*)ptr;
-   d = (char*)newMem;
-   while (limit-- > 0)
-      *d++ = *s++;
+   memcpy(newMem, ptr, limit);
 
    freechecks(to_free, file, line);
-   if (to_free->needs_free)
-      free(to_free->data - to_free->margin);
-   free(to_free);
+   release(to_free);
    return newMem;
 }
 
@@ -240,7 +709,293 @@ unsigned long report_space()
    return allocated;
 }
 
+static void put(int fd, const char *fmt, ...)
+{
+   char buf[256];
+   va_list ap;
+   int len;
+
+   va_start(ap, fmt);
+   len = vsnprintf(buf, sizeof(buf), fmt, ap);
+   va_end(ap);
+   if (len > (int)sizeof(buf) - 1)
+      len = sizeof(buf) - 1;
+   if (len > 0 && write(fd, buf, len) < 0)
+      return;
+}
+
+static int file_cmp(const char *a, const char *b)
+{
+   if (a == b)
+      return 0;
+   return strcmp(a ? a : "?", b ? b : "?");
+}
+
+static int site_cmp(const void *x, const void *y)
+{
+   const alloc_site *a = *(alloc_site * const *) x, *b = *(alloc_site * const *) y;
+   int c = file_cmp(a->file, b->file);
+
+   if (c)
+      return c;
+   return a->line < b->line ? -1 : a->line > b->line;
+}
+
+/* The text profile: one row per file:line, however many call stacks
+ * reached it.  Called with site_lock held; returns the rows written.
+ */
+static int text_profile(int fd, int sites)
+{
+   alloc_site **all, *site, sum;
+   int i, n = 0, rows = 0;
+
+   put(fd, "%10s %7s %12s %8s  site (every ~%lu bytes sampled)\n",
+    "live", "blocks", "total", "blocks", sample_mean);
+   if (sites == 0 ||
+    (all = (alloc_site **) malloc(sites * sizeof(alloc_site *))) == NULL)
+      return 0;
+   for (i = 0; i < SITE_HASH; i++)
+      for (site = site_hash[i]; site != NULL; site = site->next)
+         all[n++] = site;
+   qsort(all, n, sizeof(alloc_site *), site_cmp);
+
+   for (i = 0; i < n; i++) {
+      if (i == 0 || site_cmp(&all[i - 1], &all[i])) {
+         memset(&sum, 0, sizeof(sum));
+         sum.file = all[i]->file;
+         sum.line = all[i]->line;
+      }
+      sum.live_bytes += all[i]->live_bytes;
+      sum.live_objs += all[i]->live_objs;
+      sum.total_bytes += all[i]->total_bytes;
+      sum.total_objs += all[i]->total_objs;
+      if (i + 1 == n || site_cmp(&all[i], &all[i + 1])) {
+         put(fd, "%10lu %7lu %12lu %8lu  %s:%d\n", sum.live_bytes,
+          sum.live_objs, sum.total_bytes, sum.total_objs,
+          sum.file ? sum.file : "?", sum.line);
+         rows++;
+      }
+   }
+   free(all);
+   return rows;
+}
+
+/* Write the sampled profile to fd, either in the legacy heap format
+ * pprof reads (inuse_* and alloc_* views of the same samples, with the
+ * sampling rate so it can scale them back up) or as plain text by
+ * file and line.  Returns the number of sites written.
+ */
+int smartalloc_write_profile(int fd, int format)
+{
+   unsigned long lo = 0, lb = 0, to = 0, tb = 0;
+   alloc_site *site;
+   char buf[4096];
+   int i, j, n = 0, maps;
+   ssize_t len;
+
+   pthread_mutex_lock(&site_lock);
+   for (i = 0; i < SITE_HASH; i++)
+      for (site = site_hash[i]; site != NULL; site = site->next, n++) {
+         lo += site->live_objs;
+         lb += site->live_bytes;
+         to += site->total_objs;
+         tb += site->total_bytes;
+      }
+
+   if (format == SMARTALLOC_PROFILE_TEXT) {
+      n = text_profile(fd, n);
+      pthread_mutex_unlock(&site_lock);
+      return n;
+   }
+
+   put(fd, "heap profile: %6lu: %8lu [%6lu: %8lu] @ heap_v2/%lu\n",
+    lo, lb, to, tb, sample_mean ? sample_mean : 1);
+   for (i = 0; i < SITE_HASH; i++)
+      for (site = site_hash[i]; site != NULL; site = site->next) {
+         put(fd, "%6lu: %8lu [%6lu: %8lu] @", site->live_objs,
+          site->live_bytes, site->total_objs, site->total_bytes);
+         for (j = 0; j < site->depth; j++)
+            put(fd, " %p", site->pc[j]);
+         put(fd, "\n");
+      }
+   pthread_mutex_unlock(&site_lock);
+
+   put(fd, "\nMAPPED_LIBRARIES:\n");
+   if ((maps = open("/proc/self/maps", O_RDONLY)) >= 0) {
+      while ((len = read(maps, buf, sizeof(buf))) > 0)
+         if (write(fd, buf, len) != len)
+            break;
+      close(maps);
+   }
+   return n;
+}
+
+void smartalloc_set_owner(unsigned long (*fn)(void))
+{
+   owner_fn = fn;
+}
+
+typedef struct leak_row {
+   const char *file;
+   int line;
+   unsigned long owner;
+   unsigned long bytes;
+   unsigned long blocks;
+} leak_row;
+
+static int by_site(const void *x, const void *y)
+{
+   const leak_row *a = (const leak_row *) x, *b = (const leak_row *) y;
+   int c = file_cmp(a->file, b->file);
+
+   if (c)
+      return c;
+   if (a->line != b->line)
+      return a->line < b->line ? -1 : 1;
+   return a->owner < b->owner ? -1 : a->owner > b->owner;
+}
+
+static int by_owner(const void *x, const void *y)
+{
+   const leak_row *a = (const leak_row *) x, *b = (const leak_row *) y;
+
+   return a->owner < b->owner ? -1 : a->owner > b->owner;
+}
+
+static int by_bytes(const void *x, const void *y)
+{
+   const leak_row *a = (const leak_row *) x, *b = (const leak_row *) y;
+
+   return a->bytes > b->bytes ? -1 : a->bytes < b->bytes;
+}
+
+/* Fold rows that cmp calls equal into the first of each run. */
+static int merge_rows(leak_row *rows, int n, int (*cmp)(const void *, const void *))
+{
+   int i, out = 0;
+
+   qsort(rows, n, sizeof(leak_row), cmp);
+   for (i = 0; i < n; i++) {
+      if (out > 0 && !cmp(&rows[out - 1], &rows[i])) {
+         rows[out - 1].bytes += rows[i].bytes;
+         rows[out - 1].blocks += rows[i].blocks;
+      }
+      else
+         rows[out++] = rows[i];
+   }
+   return out;
+}
+
+/* Write what is still allocated to fd, by allocating file:line and owner
+ * (the LWP tid from the owner hook) and then per owner, largest first.
+ * This is not lock-free: the index has no safe way to reclaim nodes a
+ * lock-free walk might be standing on, so each stripe is copied out under
+ * its own lock instead, into room sized beforehand -- nothing is allocated
+ * while a lock is held, and allocation carries on everywhere else.  A
+ * node never changes stripe when the table grows, so none is counted
+ * twice.  Blocks left out of the index (sampling mode, SMARTALLOC_NO_INDEX)
+ * only show up in the total.  Returns that total.
+ */
+unsigned long smartalloc_leak_report(int fd)
+{
+   leak_row *rows = NULL, *more, *owners;
+   int n = 0, cap = 0, want, start, full, i, sites;
+   unsigned long b, total = __atomic_load_n(&allocated, __ATOMIC_RELAXED);
+   track_t *temp;
+
+   pthread_once(&init_once, smartalloc_init);
+   for (i = 0; i < STRIPES; ) {
+      /* a stripe holds about its share of the index; if it has more by
+       * the time the lock is held, drop what it gave and come back with
+       * more room
+       */
+      want = n + __atomic_load_n(&tracked, __ATOMIC_RELAXED) / STRIPES + 64;
+      if (want > cap) {
+         if ((more = (leak_row *) realloc(rows, want * sizeof(leak_row))) == NULL)
+            break;
+         rows = more;
+         cap = want;
+      }
+      start = n;
+      full = 0;
+      pthread_mutex_lock(&stripe_lock[i]);
+      for (b = i; b < hash_size && !full; b += STRIPES)
+         for (temp = track_hash[b]; temp != NULL; temp = temp->next) {
+            if (n == cap) {
+               full = 1;
+               break;
+            }
+            rows[n].file = temp->file;
+            rows[n].line = temp->line;
+            rows[n].owner = temp->owner;
+            rows[n].bytes = temp->space;
+            rows[n].blocks = 1;
+            n++;
+         }
+      pthread_mutex_unlock(&stripe_lock[i]);
+      if (full) {
+         n = start;
+         if ((more = (leak_row *) realloc(rows, 2 * cap * sizeof(leak_row))) == NULL)
+            break;
+         rows = more;
+         cap *= 2;
+         continue;
+      }
+      /* merge as we go so the copy stays the size of the report */
+      n = merge_rows(rows, n, by_site);
+      i++;
+   }
+
+   put(fd, "smartalloc: %lu bytes still allocated\n", total);
+   if (n == 0) {
+      free(rows);
+      return total;
+   }
+
+   sites = n;
+   if ((owners = (leak_row *) malloc(n * sizeof(leak_row))) != NULL)
+      memcpy(owners, rows, n * sizeof(leak_row));
+   qsort(rows, sites, sizeof(leak_row), by_bytes);
+   put(fd, "%12s %8s %6s  site\n", "bytes", "blocks", "lwp");
+   for (i = 0; i < sites; i++)
+      put(fd, "%12lu %8lu %6lu  %s:%d\n", rows[i].bytes, rows[i].blocks,
+       rows[i].owner, rows[i].file ? rows[i].file : "?", rows[i].line);
+
+   if (owners != NULL) {
+      n = merge_rows(owners, sites, by_owner);
+      qsort(owners, n, sizeof(leak_row), by_bytes);
+      put(fd, "%12s %8s %6s\n", "bytes", "blocks", "lwp");
+      for (i = 0; i < n; i++)
+         put(fd, "%12lu %8lu %6lu\n", owners[i].bytes, owners[i].blocks,
+          owners[i].owner);
+      free(owners);
+   }
+   free(rows);
+   return total;
+}
+
+static void report_handler(int signo)
+{
+   report_pending = 1;
+}
+
+/* The handler only raises a flag: the report itself takes locks, so it
+ * is written by the next smartalloc call on any thread.
+ */
+int smartalloc_report_on_signal(int signo)
+{
+   struct sigaction sa;
+
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = report_handler;
+   sigemptyset(&sa.sa_mask);
+   sa.sa_flags = SA_RESTART;
+   return sigaction(signo, &sa, NULL);
+}
+
+
+#pragma GCC visibility pop
 
 #ifdef __cplusplus
 }
-#endif
\ No newline at end of file
+#endif
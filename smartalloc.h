@@ -58,6 +58,34 @@ void smartfree(void *,const  char *, int);
 unsigned long report_space();
 void smartalloc_track(char *data, unsigned long space, unsigned char needs_free, unsigned short margin);
 
+/* How much of a freed block gets overwritten with garbage.  FULL spoils
+ * all of it, LAZY only the first few dozen bytes, and SAMPLED spoils one
+ * free in every `every' fully and the rest lazily.
+ */
+#define SMARTALLOC_POISON_FULL    0
+#define SMARTALLOC_POISON_LAZY    1
+#define SMARTALLOC_POISON_SAMPLED 2
+void smartalloc_set_poison(int mode, unsigned long every);
+
+/* Sampling profiler.  With a nonzero mean, roughly one allocation per
+ * mean_bytes allocated is sampled with its call stack and everything
+ * else skips the leak index.  The profile goes out in pprof's heap
+ * format or as text by file and line.
+ */
+#define SMARTALLOC_PROFILE_PPROF  0
+#define SMARTALLOC_PROFILE_TEXT   1
+void smartalloc_set_sampling(unsigned long mean_bytes);
+int smartalloc_write_profile(int fd, int format);
+
+/* Leak report: what is still allocated, by file:line and by owner, the
+ * value the owner hook returned at allocation time (lwp.c installs
+ * lwp_gettid).  smartalloc_report_on_signal arranges for the report to
+ * go to stderr on the next allocation after signo arrives.
+ */
+void smartalloc_set_owner(unsigned long (*fn)(void));
+unsigned long smartalloc_leak_report(int fd);
+int smartalloc_report_on_signal(int signo);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,80 @@
+/*
+ * smartstress:  hammer smartalloc from several kernel threads at once.
+ *
+ *         Each thread keeps a few hundred blocks of random sizes --
+ *         enough between them that the hash index has to grow while
+ *         the others are using it -- frees and replaces them at random,
+ *         and every so often swaps one with a shared pool so that blocks
+ *         are freed by a different thread than the one that allocated
+ *         them -- the path that goes through another thread's magazine.
+ *         Meanwhile the main thread keeps writing leak reports to
+ *         /dev/null.  Everything must be accounted for at the end.
+ *         "make stress" also runs it under ThreadSanitizer.
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "smartalloc.h"
+
+#define THREADS 8
+#define ROUNDS 200000
+#define KEEP 512
+#define POOL 64
+#define REPORTS 50
+
+static void *pool[POOL];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *work(void *arg)
+{
+   unsigned long r = (unsigned long) arg * 7919 + 1;
+   void *mine[KEEP] = {0};
+   void *t;
+   int i, j, k;
+
+   for (i = 0; i < ROUNDS; i++) {
+      r = r * 6364136223846793005UL + 1442695040888963407UL;
+      j = (r >> 33) % KEEP;
+      if (mine[j])
+         free(mine[j]);
+      mine[j] = malloc((r >> 40) % 6000);
+
+      if ((i & 63) == 0) {
+         k = (r >> 20) % POOL;
+         pthread_mutex_lock(&pool_lock);
+         t = pool[k];
+         pool[k] = mine[j];
+         mine[j] = t;
+         pthread_mutex_unlock(&pool_lock);
+      }
+   }
+   for (j = 0; j < KEEP; j++)
+      if (mine[j])
+         free(mine[j]);
+   return NULL;
+}
+
+int main(void)
+{
+   pthread_t tids[THREADS];
+   unsigned long left;
+   long i;
+   int fd = open("/dev/null", O_WRONLY);
+
+   for (i = 0; i < THREADS; i++)
+      pthread_create(&tids[i], NULL, work, (void *) i);
+   for (i = 0; i < REPORTS; i++)
+      smartalloc_leak_report(fd);
+   close(fd);
+   for (i = 0; i < THREADS; i++)
+      pthread_join(tids[i], NULL);
+   for (i = 0; i < POOL; i++)
+      if (pool[i])
+         free(pool[i]);
+
+   left = report_space();
+   printf("smartstress: %d threads, %lu bytes left\n", THREADS, left);
+   return left != 0;
+}